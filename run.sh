@@ -2,6 +2,6 @@
 
 for f in `ls scenes/*.xml`; do
   of=${f#scenes/}
-  echo "./cray $f renders/${of%.xml}.png $1 $2"
-  ./cray $f renders/${of%.xml}.png $1 $2
+  echo "./cray $f renders/${of%.xml}.png $*"
+  ./cray $f renders/${of%.xml}.png $*
 done
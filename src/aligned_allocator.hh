@@ -0,0 +1,52 @@
+#ifndef ALIGNED_ALLOCATOR_HH_
+# define ALIGNED_ALLOCATOR_HH_
+
+#include <cstdlib>
+#include <new>
+
+// An allocator returning memory aligned on align bytes, so that std::vector
+// can hold types that must not straddle cache lines (tree nodes, SIMD blocks).
+template <typename T, std::size_t align>
+class AlignedAllocator
+{
+  public:
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind
+    {
+      typedef AlignedAllocator<U, align> other;
+    };
+
+    AlignedAllocator() {}
+
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, align>&) {}
+
+    T* allocate(std::size_t n)
+    {
+      void* ptr = nullptr;
+      if (posix_memalign(&ptr, align, n * sizeof (T)) != 0)
+        throw std::bad_alloc();
+      return static_cast<T*>(ptr);
+    }
+
+    void deallocate(T* ptr, std::size_t)
+    {
+      free(ptr);
+    }
+};
+
+template <typename T, typename U, std::size_t align>
+bool operator==(const AlignedAllocator<T, align>&, const AlignedAllocator<U, align>&)
+{
+  return true;
+}
+
+template <typename T, typename U, std::size_t align>
+bool operator!=(const AlignedAllocator<T, align>&, const AlignedAllocator<U, align>&)
+{
+  return false;
+}
+
+#endif
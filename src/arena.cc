@@ -0,0 +1,49 @@
+#include "arena.hh"
+#include <cstdint>
+#include <cstdlib>
+#include <sys/mman.h>
+
+Arena::~Arena()
+{
+  for (auto d = destructors_.rbegin(); d != destructors_.rend(); ++d)
+    d->destroy(d->obj);
+
+  for (void* block : blocks_)
+    free(block);
+}
+
+void* Arena::allocate(size_t size, size_t align)
+{
+  uintptr_t cur = reinterpret_cast<uintptr_t>(cur_);
+  uintptr_t aligned = (cur + align - 1) & ~static_cast<uintptr_t>(align - 1);
+
+  if (!cur_ || aligned + size > reinterpret_cast<uintptr_t>(end_))
+  {
+    // Blocks start on ARENA_BLOCK_SIZE, which satisfies any alignment
+    newBlock(size);
+    aligned = reinterpret_cast<uintptr_t>(cur_);
+  }
+
+  cur_ = reinterpret_cast<char*>(aligned + size);
+  return reinterpret_cast<void*>(aligned);
+}
+
+void Arena::newBlock(size_t size)
+{
+  size = (size + ARENA_BLOCK_SIZE - 1) / ARENA_BLOCK_SIZE * ARENA_BLOCK_SIZE;
+  if (size == 0)
+    size = ARENA_BLOCK_SIZE;
+
+  void* block = nullptr;
+  if (posix_memalign(&block, ARENA_BLOCK_SIZE, size) != 0)
+    throw std::bad_alloc();
+
+#ifdef MADV_HUGEPAGE
+  // Only a hint: it depends on the transparent huge pages being enabled
+  madvise(block, size, MADV_HUGEPAGE);
+#endif
+
+  blocks_.push_back(block);
+  cur_ = static_cast<char*>(block);
+  end_ = cur_ + size;
+}
@@ -0,0 +1,65 @@
+#ifndef ARENA_HH_
+# define ARENA_HH_
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Size and alignment of the blocks of an Arena: the size of a huge page, so
+// that the kernel can back each block with one
+#define ARENA_BLOCK_SIZE (2 << 20)
+
+// Owns the objects of a scene (shapes, materials, camera), which are allocated
+// one after the other in large blocks and all released at once when the arena
+// is destroyed. The destructors of the objects which have one are run then, in
+// the reverse order of their allocation.
+class Arena
+{
+  public:
+    Arena() {}
+    ~Arena();
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    // Returns size bytes aligned on align (a power of two at most
+    // ARENA_BLOCK_SIZE), released with the arena
+    void* allocate(size_t size, size_t align);
+
+    // Builds a T owned by the arena
+    template <typename T, typename... Args>
+    T* make(Args&&... args)
+    {
+      void* ptr = allocate(sizeof (T), alignof (T));
+      T* obj = new (ptr) T(std::forward<Args>(args)...);
+      if (!std::is_trivially_destructible<T>::value)
+        destructors_.push_back(Destructor{&destroy<T>, obj});
+      return obj;
+    }
+
+  private:
+    struct Destructor
+    {
+      void (*destroy)(void*);
+      void* obj;
+    };
+
+    template <typename T>
+    static void destroy(void* obj)
+    {
+      static_cast<T*>(obj)->~T();
+    }
+
+    // Allocates a block of at least size bytes and makes it current
+    void newBlock(size_t size);
+
+    std::vector<void*> blocks_;
+    char* cur_ = nullptr;
+    char* end_ = nullptr;
+
+    std::vector<Destructor> destructors_;
+};
+
+#endif
@@ -1,60 +1,170 @@
 #ifndef BBOX_HH_
 # define BBOX_HH_
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
 #include "vector.hh"
 #include "ray.hh"
+#include "packet.hh"
 #include "utils.hh"
 
-class BBox
+// Axis aligned box whose bounds are stored with the precision T. The boxes of
+// the shapes are in double; the ones of the KDTree nodes are in accel_t.
+template <typename T>
+class BasicBBox
 {
   public:
-    BBox() {};
+    typedef Vector<T,3> Vec;
 
-    BBox(Vec3d min, Vec3d max) : minpt(min), maxpt(max) { }
+    BasicBBox() {};
 
-    BBox merge(BBox other)
+    BasicBBox(Vec min, Vec max) : minpt(min), maxpt(max) { }
+
+    // Conversion from another precision. The bounds are rounded outwards, so
+    // that the converted box still contains the original one.
+    template <typename U>
+    explicit BasicBBox(const BasicBBox<U>& other)
     {
-      Vec3d minp = minVec(minVec(minpt, other.minpt), minVec(maxpt, other.maxpt));
-      Vec3d maxp = maxVec(maxVec(minpt, other.minpt), maxVec(maxpt, other.maxpt));
+      for (int i = 0; i < 3; i++)
+      {
+        minpt[i] = roundDown(other.minpt[i]);
+        maxpt[i] = roundUp(other.maxpt[i]);
+      }
+    }
 
-      minpt = minp;
-      maxpt = maxp;
+    BasicBBox merge(BasicBBox other)
+    {
+      Vec lo = vmin(vmin(minpt, other.minpt), vmin(maxpt, other.maxpt));
+      Vec hi = vmax(vmax(minpt, other.minpt), vmax(maxpt, other.maxpt));
 
-      return BBox(minp, maxp);
+      minpt = lo;
+      maxpt = hi;
+      return *this;
     }
 
     bool mustShoot(const Ray& ray) const
     {
-      double tmin = 0;
-      double tmax = std::numeric_limits<double>::max();
+      double entry;
+      return mustShoot(ray, entry);
+    }
+
+    // Same as above, and sets entry to the distance along the ray at which it
+    // enters the box (0 if its origin is inside). The test is done with the
+    // precision of the box; the exit distance is slightly increased so that
+    // rounding errors do not make rays miss a box they graze.
+    bool mustShoot(const Ray& ray, double& entry) const
+    {
+      const T grow = 1 + 4 * std::numeric_limits<T>::epsilon();
+      T tmin = 0;
+      T tmax = std::numeric_limits<T>::max();
+      Vec3d orig = ray.orig();
+      Vec3d dir = ray.dir();
       for (int i = 0; i < 3; i++)
       {
-        if (ray.dir()[i] == 0)
+        T o = orig[i];
+        T d = dir[i];
+        if (d == 0)
         {
-          if (ray.orig()[i] < minpt[i] || ray.orig()[i] > maxpt[i])
+          if (o < minpt[i] || o > maxpt[i])
             return false;
         }
         else
         {
 
-          double inv = (1./ray.dir()[i]);
-          double close = (minpt[i] - ray.orig()[i]) * inv;
-          double far = (maxpt[i] - ray.orig()[i]) * inv;
+          T inv = T(1) / d;
+          T close = (minpt[i] - o) * inv;
+          T far = (maxpt[i] - o) * inv;
 
           if (close > far)
             std::swap(close, far);
 
           tmin = std::max(tmin, close);
 
-          tmax = std::min(tmax, far);
+          tmax = std::min(tmax, far * grow);
 
           if (tmin > tmax)
             return false;
         }
       }
+      entry = tmin;
       return true;
     }
 
+    // Same as mustShoot with a prepared ray, without a division per axis: a
+    // slab is entered by the side given by the sign of the direction. The
+    // axes to which the ray is parallel are tested as in mustShoot, a branch
+    // which takes the same way at every node for a given ray. Returns false
+    // if the box is entered further than limit.
+    bool intersect(const TraversalRay& ray, double limit, double& entry) const
+    {
+      const T grow = 1 + 4 * std::numeric_limits<T>::epsilon();
+      T tmin = 0;
+      T tmax = std::numeric_limits<T>::max();
+      for (int i = 0; i < 3; i++)
+      {
+        if (ray.parallel[i])
+        {
+          if (ray.orig[i] < minpt[i] || ray.orig[i] > maxpt[i])
+            return false;
+          continue;
+        }
+
+        T close = ((ray.sign[i] ? maxpt : minpt)[i] - ray.orig[i]) * ray.inv_dir[i];
+        T far = ((ray.sign[i] ? minpt : maxpt)[i] - ray.orig[i]) * ray.inv_dir[i];
+
+        tmin = std::max(tmin, close);
+        tmax = std::min(tmax, far * grow);
+      }
+      entry = tmin;
+      return tmin <= tmax && entry <= limit;
+    }
+
+    // Packet version of mustShoot: returns the lanes of active that enter the
+    // box no further than limit
+    vmask mustShoot(const RayPacket& packet, vmask active, vdouble limit) const
+    {
+      vdouble tmin = splat(0);
+      vdouble tmax = splat(std::numeric_limits<double>::max());
+      const vdouble inf = splat(std::numeric_limits<double>::infinity());
+
+      for (int i = 0; i < 3; i++)
+      {
+        vdouble lo = splat(minpt[i]);
+        vdouble hi = splat(maxpt[i]);
+        vdouble close = (lo - packet.orig[i]) * packet.inv_dir[i];
+        vdouble far = (hi - packet.orig[i]) * packet.inv_dir[i];
+
+        vmask swap = close > far;
+        vdouble tmp = close;
+        close = (swap ? far : close);
+        far = (swap ? tmp : far);
+
+        // Rays parallel to the slab only go through it if they start inside
+        vmask parallel = packet.dir[i] == splat(0);
+        vmask inside = (packet.orig[i] >= lo) & (packet.orig[i] <= hi);
+        close = (parallel ? (inside ? -inf : inf) : close);
+        far = (parallel ? (inside ? inf : -inf) : far);
+
+        tmin = vmax(tmin, close);
+        tmax = vmin(tmax, far);
+      }
+      return active & (tmin <= tmax) & (tmin <= limit);
+    }
+
+    // Surface area of the box, used by the SAH cost of the KDTree.
+    // Unbounded boxes (planes) get a huge but finite area, so that the costs
+    // they take part in can still be compared.
+    double surfaceArea() const
+    {
+      const double big = 1e100;
+      double dx = std::min(static_cast<double>(maxpt[0]) - minpt[0], big);
+      double dy = std::min(static_cast<double>(maxpt[1]) - minpt[1], big);
+      double dz = std::min(static_cast<double>(maxpt[2]) - minpt[2], big);
+
+      return 2. * (dx * dy + dy * dz + dz * dx);
+    }
+
     bool containsPoint(const Vec3d& pt) const
     {
         return pt[0] >= minpt[0] && pt[0] <= maxpt[0]
@@ -62,8 +172,32 @@ class BBox
             && pt[2] >= minpt[2] && pt[2] <= maxpt[2];
     }
 
-    Vec3d minpt;
-    Vec3d maxpt;
+    Vec minpt;
+    Vec maxpt;
+
+  private:
+    // Closest values of T below and above val; the values out of the range
+    // of T become infinite.
+    template <typename U>
+    static T roundDown(U val)
+    {
+      if (val < std::numeric_limits<T>::lowest())
+        return -std::numeric_limits<T>::infinity();
+      T ret = static_cast<T>(val);
+      return (ret > val ? std::nextafter(ret, -std::numeric_limits<T>::infinity()) : ret);
+    }
+
+    template <typename U>
+    static T roundUp(U val)
+    {
+      if (val > std::numeric_limits<T>::max())
+        return std::numeric_limits<T>::infinity();
+      T ret = static_cast<T>(val);
+      return (ret < val ? std::nextafter(ret, std::numeric_limits<T>::infinity()) : ret);
+    }
 };
 
+typedef BasicBBox<double> BBox;
+typedef BasicBBox<accel_t> NodeBBox;
+
 #endif // BBOX
@@ -1,40 +1,100 @@
+#include <algorithm>
 #include "bitmap_texture.hh"
 
+MipTexture::Level::Level(int w, int h)
+    : width(w), height(h),
+      tiles_x((w + TEXTURE_TILE - 1) / TEXTURE_TILE),
+      texels(tiles_x * ((h + TEXTURE_TILE - 1) / TEXTURE_TILE)
+             * TEXTURE_TILE * TEXTURE_TILE)
+{
+}
+
+std::array<uint8_t, 4>& MipTexture::Level::at(int x, int y)
+{
+    int tile = (y / TEXTURE_TILE) * tiles_x + x / TEXTURE_TILE;
+    int in_tile = (y % TEXTURE_TILE) * TEXTURE_TILE + x % TEXTURE_TILE;
+    return texels[tile * TEXTURE_TILE * TEXTURE_TILE + in_tile];
+}
+
+const std::array<uint8_t, 4>& MipTexture::Level::at(int x, int y) const
+{
+    return const_cast<Level*>(this)->at(x, y);
+}
+
+MipTexture::MipTexture(const cv::Mat& image,
+                       BitmapTextureTranslation translation)
+    : translation_(translation)
+{
+    levels_.emplace_back(image.cols, image.rows);
+    int cn = image.channels();
+    for (int y = 0; y < image.rows; y++)
+    {
+        const uint8_t* row = image.ptr<uint8_t>(y);
+        for (int x = 0; x < image.cols; x++)
+        {
+            // OpenCV stores the channels as BGR
+            const uint8_t* pixel = row + x * cn;
+            levels_[0].at(x, y) = {{pixel[2], pixel[1], pixel[0], 0}};
+        }
+    }
+
+    // Each texel of a level is the average of 2x2 texels of the previous one,
+    // the last row or column being repeated for odd sizes
+    while (levels_.back().width > 1 || levels_.back().height > 1)
+    {
+        const Level& prev = levels_.back();
+        Level next(std::max(1, prev.width / 2), std::max(1, prev.height / 2));
+        for (int y = 0; y < next.height; y++)
+            for (int x = 0; x < next.width; x++)
+            {
+                int x0 = 2 * x;
+                int y0 = 2 * y;
+                int x1 = std::min(x0 + 1, prev.width - 1);
+                int y1 = std::min(y0 + 1, prev.height - 1);
+                for (int c = 0; c < 3; c++)
+                    next.at(x, y)[c] = (prev.at(x0, y0)[c] + prev.at(x1, y0)[c]
+                                        + prev.at(x0, y1)[c] + prev.at(x1, y1)[c]
+                                        + 2) / 4;
+            }
+        levels_.push_back(std::move(next));
+    }
+}
+
+Color MipTexture::at(int x, int y, int level) const
+{
+    // First apply the translation; then, if outside of the image, loop back.
+    const Level& full = levels_[0];
+    x = (x + translation_.first) % full.width;
+    y = (y + translation_.second) % full.height;
+    x += (x < 0 ? full.width : 0);
+    y += (y < 0 ? full.height : 0);
+
+    const Level& cur = levels_[level];
+    const std::array<uint8_t, 4>& t = cur.at(std::min(x >> level, cur.width - 1),
+                                             std::min(y >> level, cur.height - 1));
+    return Color(t[0] / 255., t[1] / 255., t[2] / 255.);
+}
+
 /**
  * BitmapTexture constructor.
- * Because the MaterialFunctor (in Material) is built before the texture_, we
- * first define a dummy MaterialFunctor in the initialization list, then we
- * redefine it with its real value in the constructor body. That way, we can
- * safely use a lambda that captures the (const) pointer to texture_.
+ * The MaterialFunctor (in Material) is built before the texture, so we first
+ * define a dummy MaterialFunctor in the initialization list, then we redefine
+ * it with its real value in the constructor body. The texture is shared by
+ * the copies of the Material.
  * Sorry for "const" :D
  */
 BitmapTexture::BitmapTexture(cv::Mat texture,
                              PhongBundle pb,
                              float refl,
                              BitmapTextureTranslation translation)
-    : Material(nullptr, pb, refl),
-      texture_(texture),
-      translation_(translation),
-      x_max_(texture.cols - 1),
-      y_max_(texture.rows - 1)
+    : Material(MaterialFunctor(), pb, refl)
 {
+    auto mip = std::make_shared<const MipTexture>(texture, translation);
+    mip_ = mip;
+
     MaterialFunctor* noconst_func = const_cast<MaterialFunctor*>(&func_);
-    *noconst_func = *(new MaterialFunctor(
-        [this](int x, int y) -> Color
-        {
-            // First apply the translation; then, if bigger than the image,
-            // loop back.
-            x = (x + this->translation_.first)  % (this->x_max_ + 1);
-            y = (y + this->translation_.second) % (this->y_max_ + 1);
-
-            // Effective pixel color retrieval, from
-            // http://stackoverflow.com/a/7903042
-            uint8_t* pixelPtr = (uint8_t*)this->texture_.data;
-            int cn = this->texture_.channels();
-            int blue  = pixelPtr[x*cn*this->texture_.cols + y*cn + 0]; // B
-            int green = pixelPtr[x*cn*this->texture_.cols + y*cn + 1]; // G
-            int red   = pixelPtr[x*cn*this->texture_.cols + y*cn + 2]; // R
-            return Color(red, green, blue);
-        }
-    ));
+    *noconst_func = [mip](int x, int y) -> Color
+    {
+        return mip->at(x, y, 0);
+    };
 }
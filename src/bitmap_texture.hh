@@ -1,13 +1,55 @@
 #ifndef BITMAP_TEXTURE_HH
 # define BITMAP_TEXTURE_HH
 
+# include <array>
+# include <cstdint>
 # include <utility>
+# include <vector>
 # include <cv.h>
 # include "material.hh"
 
 /** A translation according to x (first) and y (second) coordinates. */
 using BitmapTextureTranslation = std::pair<int, int>;
 
+/**
+ * Side (a power of two) of the square tiles in which the texels of a
+ * MipTexture are stored: a tile of 4x4 RGBA texels fills a cache line.
+ */
+# define TEXTURE_TILE 4
+
+/**
+ * An image converted into a mip chain: each level is half as large as the
+ * previous one, down to 1x1, and stores its texels tile by tile (row by row
+ * inside a tile) so that neighbouring lookups stay in the same cache lines.
+ */
+class MipTexture
+{
+public:
+    MipTexture(const cv::Mat& image, BitmapTextureTranslation translation);
+
+    /** Color of the image at (x, y), looked up in the given level */
+    Color at(int x, int y, int level) const;
+
+    int levels() const { return levels_.size(); }
+
+private:
+    struct Level
+    {
+        Level(int w, int h);
+
+        inline std::array<uint8_t, 4>& at(int x, int y);
+        inline const std::array<uint8_t, 4>& at(int x, int y) const;
+
+        int width;
+        int height;
+        int tiles_x;
+        std::vector<std::array<uint8_t, 4>> texels;
+    };
+
+    std::vector<Level>              levels_;
+    const BitmapTextureTranslation  translation_;
+};
+
 class BitmapTexture: public Material
 {
 public:
@@ -21,12 +63,6 @@ public:
                   PhongBundle,
                   float refl,
                   BitmapTextureTranslation = std::make_pair(0, 0));
-
-private:
-    const cv::Mat                   texture_;
-    const BitmapTextureTranslation  translation_;
-    const int x_max_;
-    const int y_max_;
 };
 
 #endif // !BITMAP_TEXTURE_HH
@@ -1,7 +1,7 @@
 #include "camera.hh"
 
 
-Camera* Camera::parse(tinyxml2::XMLNode* node, int x, int y)
+Camera* Camera::parse(tinyxml2::XMLNode* node, int x, int y, Arena& arena)
 {
   Vec3d pos;
   Vec3d dir;
@@ -43,5 +43,5 @@ Camera* Camera::parse(tinyxml2::XMLNode* node, int x, int y)
     exit(1);
   }
 
-  return new Camera(pos,dir,up,x,y);
+  return arena.make<Camera>(pos,dir,up,x,y);
 }
@@ -1,7 +1,7 @@
 #ifndef CAMERA_HH_
 # define CAMERA_HH_
 
-#include <vector>
+#include "arena.hh"
 #include "vector.hh"
 #include "ray.hh"
 #include "utils.hh"
@@ -22,39 +22,44 @@ class Camera
       double fov = M_PI_4;
       fovx_ = tan(fov);
       fovy_ = ((double) y_)/((double) x_) * M_PI_4;
+
+      // Those two vector define the tangent plane to the camera direction
+      // that we use to cast the rays
+      cam_right_ = normalize(up_.cross(dir_));
+      cam_up_    = normalize(dir_.cross(cam_right_));
+      center_ = pos_ + dir_;
+
+      inv_x_ = 1. / static_cast<double>(x_);
+      inv_y_ = 1. / static_cast<double>(y_);
     }
 
-    static Camera* parse(tinyxml2::XMLNode* node, int x, int y);
+    static Camera* parse(tinyxml2::XMLNode* node, int x, int y, Arena& arena);
 
-    std::vector<Ray>& getRays(void)
+    // The ray going through the point (i,j) of the image, in pixels: the
+    // pixel (i,j) starts at its integer coordinates, and the fractional ones
+    // are used for supersampling. The rays are computed on demand, so that
+    // rendering does not need memory proportional to the image.
+    Ray getRay(double i, double j) const
     {
-      std::vector<Ray>* rayMat = new std::vector<Ray> (x_ * y_);
+      // The pixel (i,j) is normalised, centered, and the affected by the
+      // FOV
+      double normal_i = (i * inv_x_ - 0.5) * fovx_;
+      double normal_j = (j * inv_y_ - 0.5) * fovy_;
 
-      // Those two vector define the tangent plane to the camera direction
-      // that we use to cast the rays
-      Vec3d cam_right = normalize(up_.cross(dir_));
-      Vec3d cam_up    = normalize(dir_.cross(cam_right));
-      double xd = static_cast<double>(x_);
-      double yd = static_cast<double>(y_);
-
-      Vec3d center = pos_ + dir_;
-
-      for (int j = 0; j < y_; j++)
-        for (int i = 0; i < x_; i++)
-        {
-          // The pixel (i,j) is normalised, centered, and the affected by the
-          // FOV
-          double normal_i = (static_cast<double>(i)/xd - 0.5) * fovx_;
-          double normal_j = (static_cast<double>(j)/yd - 0.5) * fovy_;
-
-          // it is then projected on the tangent plane
-          Vec3d pt = normal_i * cam_right + normal_j * cam_up + center;
-          Vec3d pt_dir = normalize(pt - pos_);
-
-          rayMat->at(j * x_ + i) = Ray(pt, pt_dir);
-        }
-      return *rayMat;
+      // it is then projected on the tangent plane
+      Vec3d pt = normal_i * cam_right_ + normal_j * cam_up_ + center_;
+      Vec3d pt_dir = normalize(pt - pos_);
+
+      return Ray(pt, pt_dir);
+    }
+
+    // Width of the area seen through one pixel at a unit distance from the
+    // camera
+    double pixelSpread() const
+    {
+      return fovx_ * inv_x_ / dir_.norm();
     }
+
   private:
     // The dimension of the image generated
     int x_;
@@ -69,6 +74,14 @@ class Camera
     Vec3d dir_;
     // Its vertical orientation
     Vec3d up_;
+
+    // The basis of the tangent plane, and its center
+    Vec3d cam_right_;
+    Vec3d cam_up_;
+    Vec3d center_;
+    // Inverse of the dimensions of the image
+    double inv_x_;
+    double inv_y_;
 };
 
 #undef _USE_MATH_DEFINES
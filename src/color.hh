@@ -1,7 +1,6 @@
 #ifndef COLOR_HH_
 # define COLOR_HH_
 
-#include <cv.h>
 #include <tinyxml2.h>
 #include "vector.hh"
 
@@ -35,17 +34,6 @@ class Color
     double b() {return b_;}
     double max() {return max_val_;}
 
-    // Conversion to the color representation of OpenCV
-    cv::Vec3b toBgr()
-    {
-      if (max_val_ == 0)
-        return cv::Vec3b(0,0,0);
-      int r = (r_/max_val_) * 255;
-      int g = (g_/max_val_) * 255;
-      int b = (b_/max_val_) * 255;
-      return cv::Vec3b(b,g,r);
-    }
-
   private:
     double r_, g_, b_, max_val_;
 };
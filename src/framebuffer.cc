@@ -0,0 +1,45 @@
+#include "framebuffer.hh"
+
+void Framebuffer::average(int index, const Color* colors, int count)
+{
+  float* pixel = &radiance_[3 * index];
+  float sum[3] = {pixel[0], pixel[1], pixel[2]};
+
+  for (int p = 0; p < count; p++)
+  {
+    float sample[3];
+    normalize(colors[p], sample);
+    for (int c = 0; c < 3; c++)
+      sum[c] += sample[c];
+  }
+
+  float inv_count = 1.f / (count + 1);
+  for (int c = 0; c < 3; c++)
+    pixel[c] = sum[c] * inv_count;
+}
+
+// Clamps a radiance to [0, 1] and quantizes it to 8 bits
+static inline unsigned char quantize(float val)
+{
+  val = (val < 0 ? 0 : (val > 1 ? 1 : val));
+  return static_cast<unsigned char>(val * 255);
+}
+
+cv::Mat Framebuffer::toImage() const
+{
+  cv::Mat img (y_, x_, CV_8UC3);
+
+  for (int j = 0; j < y_; j++)
+  {
+    const float* src = &radiance_[3 * j * x_];
+    unsigned char* dst = img.ptr<unsigned char>(j);
+    for (int i = 0; i < x_; i++)
+    {
+      dst[3 * i] = quantize(src[3 * i + 2]);
+      dst[3 * i + 1] = quantize(src[3 * i + 1]);
+      dst[3 * i + 2] = quantize(src[3 * i]);
+    }
+  }
+
+  return img;
+}
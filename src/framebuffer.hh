@@ -0,0 +1,57 @@
+#ifndef FRAMEBUFFER_HH_
+# define FRAMEBUFFER_HH_
+
+#include <vector>
+#include <cv.h>
+#include "color.hh"
+
+// The linear radiance of the rendered pixels, as packed float RGB triples.
+// The colors computed by the rays are normalized when they are stored, and
+// the image is only clamped and quantized to 8 bits when it is saved.
+class Framebuffer
+{
+  public:
+    Framebuffer() {}
+
+    Framebuffer(int x, int y) : x_(x), y_(y), radiance_(3 * x * y, 0) {}
+
+    // Sets the pixel at index to the normalized value of c, an empty color
+    // being black
+    void set(int index, Color c)
+    {
+      normalize(c, &radiance_[3 * index]);
+    }
+
+    // Replaces the pixel at index by the average of its current value and of
+    // the count given colors (samples of the pixel)
+    void average(int index, const Color* colors, int count);
+
+    // Radiance of the pixel at index on channel (0: red, 1: green, 2: blue)
+    float at(int index, int channel) const
+    {
+      return radiance_[3 * index + channel];
+    }
+
+    // The image clamped to [0, 1] and quantized, in the BGR layout of OpenCV
+    cv::Mat toImage() const;
+
+  private:
+    static void normalize(Color c, float* pixel)
+    {
+      if (c.max() == 0)
+      {
+        pixel[0] = pixel[1] = pixel[2] = 0;
+        return;
+      }
+      double inv_max = 1. / c.max();
+      pixel[0] = c.r() * inv_max;
+      pixel[1] = c.g() * inv_max;
+      pixel[2] = c.b() * inv_max;
+    }
+
+    int x_ = 0;
+    int y_ = 0;
+    std::vector<float> radiance_;
+};
+
+#endif
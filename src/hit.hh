@@ -0,0 +1,59 @@
+#ifndef HIT_HH_
+# define HIT_HH_
+
+#include <limits>
+#include "ray.hh"
+#include "vector.hh"
+
+class Shape;
+
+// Where a ray hits a shape. The intersection sets the shape, the distance
+// along the ray, the point and the triangle of a mesh; once the closest hit
+// is known, Shape::completeHit adds what shading needs, so that nothing is
+// intersected again to shade it.
+struct Hit
+{
+  Shape* shape = nullptr;
+  double dist = std::numeric_limits<double>::infinity();
+  Vec3d point;
+
+  // Triangle hit in a mesh (-1 for the other shapes), and the barycentric
+  // coordinates of the point in it: the weights of its second and third
+  // vertices
+  int primitive = -1;
+  double u = 0;
+  double v = 0;
+
+  // Normal of the surface, and normal used for shading, which is interpolated
+  // between the normals of the vertices of a mesh if it has any
+  Vec3d normal;
+  Vec3d shading_normal;
+
+  // Planes and triangles have no outside: their normal is turned toward the
+  // side a ray goes to. The normal of a sphere always points outwards.
+  bool two_sided = true;
+
+  // The shading normal seen by a ray going along dir
+  Vec3d normalAlong(const Vec3d& dir) const
+  {
+    if (two_sided && shading_normal.dot(dir) < 0)
+      return -shading_normal;
+    return shading_normal;
+  }
+
+  // The reflection at the hit point of a ray going along dir, shifted out of
+  // the surface
+  Ray reflect(const Vec3d& dir) const
+  {
+    Vec3d normal_dir = normalAlong(-dir);
+    Vec3d refl_dir = dir - 2.0 * normal_dir * dir.dot(normal_dir);
+
+    // Because of the double imprecision, we have to shift the reflected ray out
+    // of the shape.
+    const double shift = std::numeric_limits<double>::epsilon() * 65536.0;
+
+    return Ray(point + normal_dir * shift, normalize(refl_dir));
+  }
+};
+
+#endif
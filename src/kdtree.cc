@@ -1,147 +1,545 @@
 #include "kdtree.hh"
+#include <algorithm>
+#include <chrono>
 
-BBox KDTree::sBuildTree(const std::vector<Shape*>& shapes, int depth)
+void KDTree::buildTree(const std::vector<Shape*>& shapes)
 {
-    left_ = nullptr;
-    right_ = nullptr;
-    if (shapes.size() == 1)
+    std::vector<Primitive> prims(shapes.size());
+    for (uint32_t i = 0; i < shapes.size(); i++)
     {
-        shape_ = shapes[0];
-        bbox_ = shape_->getBBox();
+        prims[i].bbox = shapes[i]->getBBox();
+        prims[i].center = shapes[i]->center();
+        prims[i].index = i;
+    }
+
+    buildTree(prims);
 
-        return bbox_;
+    shapes_.resize(shapes.size());
+    instances_.resize(shapes.size());
+    for (uint32_t i = 0; i < shapes.size(); i++)
+    {
+        shapes_[i] = shapes[prims[i].index];
+        instances_[i] = shapes_[i]->instanceTree();
     }
+}
 
-    int dim = depth % 3;
+void KDTree::buildTree(std::vector<Primitive>& prims)
+{
+    auto start = std::chrono::steady_clock::now();
 
-    unsigned int shape_i = -1;
-    splitpos_ = Vec3d (0.,0.,0.);
-    splitpos_[dim] = findBestSplit(shapes, shape_i, dim);
+    // prims is partitioned in place while the tree is built, so that the
+    // primitives of every leaf end up next to each other
+    std::shared_ptr<NodeArray> nodes = std::make_shared<NodeArray>();
+    nodes->reserve(2 * prims.size() + 1);
+
+    if (prims.size() > KDTREE_PARALLEL_MIN)
+    {
+        ThreadPool pool(0);
+        sBuildTree(prims, 0, prims.size(), *nodes, &pool);
+    }
+    else
+        sBuildTree(prims, 0, prims.size(), *nodes, nullptr);
 
-    std::vector<Shape*> lshapes;
+    nodes_ = nodes->data();
+    node_count_ = nodes->size();
+    storage_ = nodes;
+    shapes_.clear();
+    instances_.clear();
+    triangles_ = TriangleBlock();
 
-    std::vector<Shape*> rshapes;
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "Tree build: " << elapsed.count() << "s" << std::endl;
+}
+
+BBox KDTree::centerBounds(const std::vector<Primitive>& prims, uint32_t begin,
+                          uint32_t end)
+{
+    BBox bounds(prims[begin].center, prims[begin].center);
+
+    for (uint32_t i = begin + 1; i < end; i++)
+        bounds.merge(BBox(prims[i].center, prims[i].center));
+
+    return bounds;
+}
+
+int KDTree::binOf(const Primitive& p, const BBox& bounds, int dim)
+{
+    double extent = bounds.maxpt[dim] - bounds.minpt[dim];
+    if (extent <= 0)
+        return 0;
 
-    shape_ = shapes[shape_i];
-    bbox_ = shape_->getBBox();
+    int bin = static_cast<int>(KDTREE_SAH_BINS
+                               * (p.center[dim] - bounds.minpt[dim]) / extent);
 
-    for (unsigned int i = 0; i < shapes.size(); i++)
+    return std::min(bin, KDTREE_SAH_BINS - 1);
+}
+
+void KDTree::makeLeaf(NodeArray& nodes, uint32_t node, uint32_t begin,
+                      uint32_t end)
+{
+    nodes[node].axis = KDTREE_LEAF;
+    nodes[node].offset = begin;
+    nodes[node].count = end - begin;
+}
+
+uint32_t KDTree::sBuildTree(std::vector<Primitive>& prims, uint32_t begin,
+                            uint32_t end, NodeArray& nodes, ThreadPool* pool,
+                            unsigned int depth)
+{
+    uint32_t node = nodes.size();
+    nodes.push_back(Node());
+    uint32_t count = end - begin;
+
+    if (count == 0)
     {
-        if (i == shape_i) continue;
+        nodes[node].bbox = NodeBBox(BBox(Vec3d(0, 0, 0), Vec3d(0, 0, 0)));
+        makeLeaf(nodes, node, begin, end);
+        return node;
+    }
 
-        if (interLeft(shapes[i], splitpos_, dim))
-            lshapes.push_back(shapes[i]);
-        if (interRight(shapes[i], splitpos_, dim))
-            rshapes.push_back(shapes[i]);
+    BBox bbox = prims[begin].bbox;
+    for (uint32_t i = begin + 1; i < end; i++)
+        bbox.merge(prims[i].bbox);
+    nodes[node].bbox = NodeBBox(bbox);
+
+    if (count == 1)
+    {
+        makeLeaf(nodes, node, begin, end);
+        return node;
     }
 
-    if (lshapes.size() != 0)
+    BBox bounds = centerBounds(prims, begin, end);
+    int dim = 0;
+    int bin = 0;
+    double split_cost = 0;
+    bool can_split = findBestSplit(prims, begin, end, bounds, dim, bin,
+                                   split_cost);
+
+    // Costs relative to the surface area of this node
+    double area = bbox.surfaceArea();
+    double leaf_cost = KDTREE_INTERSECTION_COST * count * area;
+    split_cost = KDTREE_TRAVERSAL_COST * area
+               + KDTREE_INTERSECTION_COST * split_cost;
+
+    if (count <= KDTREE_MAX_LEAF_SIZE
+        && (!can_split || split_cost >= leaf_cost))
     {
-        left_ = new KDTree ();
-        bbox_.merge(left_->sBuildTree(lshapes, depth + 1));
+        makeLeaf(nodes, node, begin, end);
+        return node;
     }
 
-    if (rshapes.size() != 0)
+    uint32_t middle;
+    if (!can_split)
     {
-        right_ = new KDTree();
-        bbox_.merge(right_->sBuildTree(rshapes, depth + 1));
+        // Every center is at the same place: the primitives are cut in two
+        // halves so that the leaves stay small.
+        middle = begin + count / 2;
+    }
+    else if (depth >= KDTREE_MAX_DEPTH)
+    {
+        // The traversals have a stack of fixed size: the primitives are cut
+        // in two halves along the axis of the best split
+        middle = begin + count / 2;
+        std::nth_element(prims.begin() + begin, prims.begin() + middle,
+                         prims.begin() + end,
+                         [dim](const Primitive& a, const Primitive& b)
+                         {
+                             return a.center[dim] < b.center[dim];
+                         });
+    }
+    else
+    {
+        auto left = [&bounds, dim, bin](const Primitive& p)
+        {
+            return binOf(p, bounds, dim) <= bin;
+        };
+        middle = std::partition(prims.begin() + begin, prims.begin() + end,
+                                left) - prims.begin();
     }
 
-    return bbox_;
-}
+    nodes[node].axis = dim;
+    nodes[node].count = 0;
 
-double KDTree::findBestSplit(const std::vector<Shape*> shapes,
-                             unsigned int& shape_i,
-                             int dim)
-{
-    std::vector<double> centers(shapes.size());
+    if (!pool || count <= KDTREE_PARALLEL_MIN)
+    {
+        // The left child is built right after its parent
+        sBuildTree(prims, begin, middle, nodes, pool, depth + 1);
+        uint32_t right = sBuildTree(prims, middle, end, nodes, pool, depth + 1);
+        nodes[node].offset = right;
+        return node;
+    }
+
+    // The right child is built in its own array by another task while this
+    // one builds the left child, and is appended once both are done
+    NodeArray right_nodes;
+    std::atomic<bool> right_done (false);
+    pool->push([this, &prims, middle, end, &right_nodes, pool, depth,
+                &right_done]
+    {
+        sBuildTree(prims, middle, end, right_nodes, pool, depth + 1);
+        right_done = true;
+    });
 
-    for (unsigned int i = 0; i < shapes.size(); i++)
-        centers[i] = shapes[i]->center()[dim];
-    std::sort(centers.begin(), centers.end());
+    sBuildTree(prims, begin, middle, nodes, pool, depth + 1);
+    pool->helpUntil(right_done);
 
-    shape_i = centers.size()/2;
-    return centers[shape_i];
+    // The inner nodes of the right child point to nodes of right_nodes; the
+    // leaves point to prims, which is shared
+    uint32_t right = nodes.size();
+    for (Node n : right_nodes)
+    {
+        if (!n.isLeaf())
+            n.offset += right;
+        nodes.push_back(n);
+    }
+    nodes[node].offset = right;
+
+    return node;
 }
 
-Shape* KDTree::intersect(const Ray& r, Vec3d& intersect, double& dist) const
+bool KDTree::findBestSplit(const std::vector<Primitive>& prims,
+                           uint32_t begin,
+                           uint32_t end,
+                           const BBox& bounds,
+                           int& dim,
+                           int& bin,
+                           double& cost)
 {
-    if (bbox_.mustShoot(r))
+    bool found = false;
+
+    for (int d = 0; d < 3; d++)
     {
-        double best_dist;
-        Vec3d best_inter;
-        bool hit = false;
-        Shape* ret = nullptr;
+        if (bounds.maxpt[d] - bounds.minpt[d] <= 0)
+            continue;
 
-        if (shape_)
+        BBox boxes[KDTREE_SAH_BINS];
+        unsigned int counts[KDTREE_SAH_BINS] = {0};
+
+        for (uint32_t i = begin; i < end; i++)
         {
-            hit = shape_->intersect(r, best_inter, best_dist);
-            if (hit)
-                ret = shape_;
+            int b = binOf(prims[i], bounds, d);
+            if (counts[b]++ == 0)
+                boxes[b] = prims[i].bbox;
+            else
+                boxes[b].merge(prims[i].bbox);
         }
 
-        Vec3d cur_inter;
-        double cur_dist = -1;
+        // Sweep from the right to get the cost of every right child, then
+        // from the left to combine it with the cost of the left child
+        double right_costs[KDTREE_SAH_BINS];
+        BBox acc;
+        unsigned int acc_count = 0;
+        for (int b = KDTREE_SAH_BINS - 1; b > 0; b--)
+        {
+            if (counts[b] != 0)
+            {
+                if (acc_count == 0)
+                    acc = boxes[b];
+                else
+                    acc.merge(boxes[b]);
+                acc_count += counts[b];
+            }
+            right_costs[b - 1] = (acc_count == 0 ? -1 : acc.surfaceArea() * acc_count);
+        }
 
-        if (left_)
+        acc_count = 0;
+        for (int b = 0; b < KDTREE_SAH_BINS - 1; b++)
         {
-            Shape* sit = left_->intersect(r, cur_inter, cur_dist);
-            if (sit && (!hit || cur_dist < best_dist))
+            if (counts[b] != 0)
+            {
+                if (acc_count == 0)
+                    acc = boxes[b];
+                else
+                    acc.merge(boxes[b]);
+                acc_count += counts[b];
+            }
+
+            if (acc_count == 0 || right_costs[b] < 0)
+                continue;
+
+            double cur_cost = acc.surfaceArea() * acc_count + right_costs[b];
+            if (!found || cur_cost < cost)
             {
-                best_dist = cur_dist;
-                best_inter = cur_inter;
-                ret = sit;
-                hit = true;
+                found = true;
+                cost = cur_cost;
+                dim = d;
+                bin = b;
             }
         }
+    }
+
+    return found;
+}
+
+double KDTree::recCost(uint32_t node, double root_area) const
+{
+    const Node& n = nodes_[node];
+    double area_ratio = n.bbox.surfaceArea() / root_area;
+
+    if (n.isLeaf())
+        return KDTREE_INTERSECTION_COST * n.count * area_ratio;
+
+    return KDTREE_TRAVERSAL_COST * area_ratio
+         + recCost(node + 1, root_area)
+         + recCost(n.offset, root_area);
+}
+
+int KDTree::traverse(uint32_t node, const Ray& r, Hit& hit) const
+{
+    const TraversalRay world (r);
+
+    // The tree whose nodes are being visited, with the ray in its coordinates:
+    // this one, or the tree of the instance shapes_[instance]
+    const KDTree* tree = this;
+    int instance = -1;
+    TraversalRay ray = world;
 
-        if (right_)
+    StackEntry stack[KDTREE_STACK_SIZE];
+    int top = 0;
+    stack[top++] = StackEntry{node, -1};
+
+    int ret = -1;
+    while (top > 0)
+    {
+        StackEntry cur = stack[--top];
+        if (cur.instance != instance)
+        {
+            instance = cur.instance;
+            tree = (instance < 0 ? this : instances_[instance]);
+            ray = (instance < 0 ? world
+                   : TraversalRay(shapes_[instance]->toInstance(r)));
+        }
+
+        const Node& n = tree->nodes_[cur.node];
+        double entry;
+        if (!n.bbox.intersect(ray, hit.dist, entry))
+            continue;
+
+        if (!n.isLeaf())
+        {
+            // The near child is on top, so it is visited first
+            uint32_t near = cur.node + 1;
+            uint32_t far = n.offset;
+            if (ray.sign[n.axis])
+                std::swap(near, far);
+
+            assert(top + 2 <= KDTREE_STACK_SIZE);
+            stack[top++] = StackEntry{far, instance};
+            stack[top++] = StackEntry{near, instance};
+            continue;
+        }
+
+        if (!tree->triangles_.empty())
         {
-            Shape* sit = right_->intersect(r, cur_inter, cur_dist);
-            if (sit && (!hit || cur_dist < best_dist))
+            // The distances along the ray are the same in the coordinates of
+            // an instance
+            int t = tree->triangles_.intersect(ray.ray, n.offset, n.count,
+                                               hit.dist);
+            if (t >= 0)
             {
-                best_dist = cur_dist;
-                best_inter = cur_inter;
-                ret = sit;
-                hit = true;
+                hit.point = r.orig() + hit.dist * r.dir();
+                hit.primitive = t;
+                if (instance < 0)
+                    ret = t;
+                else
+                {
+                    hit.shape = shapes_[instance];
+                    ret = instance;
+                }
             }
+            continue;
         }
 
-        intersect = best_inter;
-        dist = best_dist;
-        return ret;
+        // Only the tree of the scene holds shapes: the roots of the
+        // instances are pushed, and the other shapes intersected
+        for (uint32_t i = n.offset; i < n.offset + n.count; i++)
+        {
+            if (instances_[i])
+            {
+                assert(top < KDTREE_STACK_SIZE);
+                stack[top++] = StackEntry{0, static_cast<int32_t>(i)};
+            }
+            else if (shapes_[i]->intersect(r, hit))
+            {
+                hit.shape = shapes_[i];
+                ret = i;
+            }
+        }
     }
-    else
+
+    return ret;
+}
+
+bool KDTree::traverseOccluded(uint32_t node, const Ray& r, double max_dist) const
+{
+    const TraversalRay world (r);
+
+    // Same as traverse
+    const KDTree* tree = this;
+    int instance = -1;
+    TraversalRay ray = world;
+
+    StackEntry stack[KDTREE_STACK_SIZE];
+    int top = 0;
+    stack[top++] = StackEntry{node, -1};
+
+    while (top > 0)
     {
-        return nullptr;
+        StackEntry cur = stack[--top];
+        if (cur.instance != instance)
+        {
+            instance = cur.instance;
+            tree = (instance < 0 ? this : instances_[instance]);
+            ray = (instance < 0 ? world
+                   : TraversalRay(shapes_[instance]->toInstance(r)));
+        }
+
+        const Node& n = tree->nodes_[cur.node];
+        double entry;
+        if (!n.bbox.intersect(ray, max_dist, entry))
+            continue;
+
+        if (!n.isLeaf())
+        {
+            uint32_t near = cur.node + 1;
+            uint32_t far = n.offset;
+            if (ray.sign[n.axis])
+                std::swap(near, far);
+
+            assert(top + 2 <= KDTREE_STACK_SIZE);
+            stack[top++] = StackEntry{far, instance};
+            stack[top++] = StackEntry{near, instance};
+            continue;
+        }
+
+        if (!tree->triangles_.empty())
+        {
+            if (tree->triangles_.occludes(ray.ray, n.offset, n.count, max_dist))
+                return true;
+            continue;
+        }
+
+        for (uint32_t i = n.offset; i < n.offset + n.count; i++)
+        {
+            if (instances_[i])
+            {
+                assert(top < KDTREE_STACK_SIZE);
+                stack[top++] = StackEntry{0, static_cast<int32_t>(i)};
+            }
+            else if (shapes_[i]->occludes(r, max_dist))
+                return true;
+        }
     }
+
+    return false;
 }
 
-Shape* KDTree::recFindSurroundingShape(const Vec3d& pt, char dim) const
+// Index of the first lane set in mask
+static int firstLane(vmask mask)
 {
-    if (!bbox_.containsPoint(pt))
+    int i = 0;
+    while (i < PACKET_SIZE - 1 && !mask[i])
+        i++;
+    return i;
+}
+
+void KDTree::recIntersect(uint32_t node, const RayPacket& packet, vmask active,
+                          PacketHit& hit) const
+{
+    const Node& n = nodes_[node];
+
+    active = n.bbox.mustShoot(packet, active, hit.dist);
+    int lanes = countLanes(active);
+    if (lanes == 0)
+        return;
+
+    if (lanes < KDTREE_PACKET_MIN_LANES)
     {
-        return nullptr;
+        for (int i = 0; i < PACKET_SIZE; i++)
+        {
+            if (!active[i])
+                continue;
+
+            Hit lane;
+            lane.dist = hit.dist[i];
+            int s = traverse(node, packet.ray(i), lane);
+            if (s >= 0)
+            {
+                hit.dist[i] = lane.dist;
+                hit.index[i] = s;
+                hit.primitive[i] = lane.primitive;
+            }
+        }
+        return;
     }
 
-    assert(shape_ != nullptr);
+    if (n.isLeaf() && !triangles_.empty())
+    {
+        triangles_.intersect(packet, active, n.offset, n.count, hit);
+        return;
+    }
 
-    if (shape_->containsPoint(pt))
+    if (n.isLeaf())
     {
-        return shape_;
+        for (uint32_t s = n.offset; s < n.offset + n.count; s++)
+        {
+            vmask hits = shapes_[s]->intersectPacket(packet, active, hit);
+            for (int i = 0; i < PACKET_SIZE; i++)
+                if (hits[i])
+                    hit.index[i] = s;
+        }
+        return;
     }
 
-    dim %= 3;
+    uint32_t near;
+    uint32_t far;
+    orderChildren(node, packet.dir[n.axis][firstLane(active)], near, far);
+
+    recIntersect(near, packet, active, hit);
+    recIntersect(far, packet, active, hit);
+}
+
+vmask KDTree::recOccluded(uint32_t node, const RayPacket& packet, vmask active,
+                          vdouble max_dist) const
+{
+    const Node& n = nodes_[node];
+
+    active = n.bbox.mustShoot(packet, active, max_dist);
+    int lanes = countLanes(active);
+    if (lanes == 0)
+        return active;
 
-    if (left_ != nullptr && pt[dim] < this->splitpos_[dim])
+    if (lanes < KDTREE_PACKET_MIN_LANES)
     {
-        return left_->recFindSurroundingShape(pt, dim + 1);
+        for (int i = 0; i < PACKET_SIZE; i++)
+            if (active[i] && !traverseOccluded(node, packet.ray(i), max_dist[i]))
+                active[i] = 0;
+        return active;
     }
 
-    if (right_ != nullptr && pt[dim] > this->splitpos_[dim])
+    if (n.isLeaf() && !triangles_.empty())
+        return triangles_.occludes(packet, active, n.offset, n.count, max_dist);
+
+    vmask occluded = splatMask(false);
+
+    if (n.isLeaf())
     {
-        return right_->recFindSurroundingShape(pt, dim + 1);
+        for (uint32_t s = n.offset; s < n.offset + n.count; s++)
+        {
+            occluded |= shapes_[s]->occludesPacket(packet, active & ~occluded,
+                                                   max_dist);
+            if (countLanes(active & ~occluded) == 0)
+                break;
+        }
+        return occluded;
     }
 
-    return nullptr;
+    uint32_t near;
+    uint32_t far;
+    orderChildren(node, packet.dir[n.axis][firstLane(active)], near, far);
+
+    occluded = recOccluded(near, packet, active, max_dist);
+    if (countLanes(active & ~occluded) != 0)
+        occluded |= recOccluded(far, packet, active & ~occluded, max_dist);
+    return occluded;
 }
@@ -1,38 +1,195 @@
 #ifndef KDTREE_HH_
 # define KDTREE_HH_
 
+#include <cstdint>
+#include <memory>
 #include "shape.hh"
 #include "bbox.hh"
 #include "vector.hh"
+#include "aligned_allocator.hh"
+#include "triangle_block.hh"
+#include "thread_pool.hh"
 #include <assert.h>
 
+// Surface area heuristic parameters: the estimated cost of traversing a node
+// and of intersecting a shape, the number of bins in which the split
+// candidates are evaluated on each axis, and the size above which a node is
+// split even if the heuristic says it is not worth it.
+#define KDTREE_TRAVERSAL_COST 1.
+#define KDTREE_INTERSECTION_COST 1.5
+#define KDTREE_SAH_BINS 16
+#define KDTREE_MAX_LEAF_SIZE 16
+
+// Subtrees with more shapes than this are built as tasks of a thread pool
+#define KDTREE_PARALLEL_MIN 4096
+
+// A packet with fewer active rays than this is traced one ray at a time
+#define KDTREE_PACKET_MIN_LANES 2
+
+// Axis tag of the leaves
+#define KDTREE_LEAF 3
+
+// Below this depth, the nodes which still have to be split are cut at their
+// median center, so that no tree is deeper than KDTREE_MAX_DEPTH plus the
+// 32 levels of halving 2^32 primitives
+#define KDTREE_MAX_DEPTH 48
+
+// Entries of the stack of the traversals: the far children pushed on the way
+// down a tree of the scene, the roots of the instances of a leaf, and the far
+// children of the tree of one of them
+#define KDTREE_STACK_SIZE (2 * (KDTREE_MAX_DEPTH + 32) + KDTREE_MAX_LEAF_SIZE)
+
+class Mesh;
+class MeshCache;
+
 class KDTree
 {
   public:
-    inline void buildTree(const std::vector<Shape*>& shapes);
+    // The tree is stored as an array of nodes in depth-first order: the left
+    // child of an inner node is the next node of the array, and the shapes of
+    // the leaves are stored in the order in which the leaves are laid out.
+    // A node takes 64 bytes with double boxes and 32 bytes with float ones,
+    // so that no node straddles two cache lines.
+    struct alignas(32) Node
+    {
+      NodeBBox bbox;
+      // Index of the right child for inner nodes, of the first shape for leaves
+      uint32_t offset;
+      // Number of shapes of a leaf
+      uint16_t count;
+      // Split axis, or KDTREE_LEAF
+      uint8_t axis;
+
+      bool isLeaf() const {return axis == KDTREE_LEAF;}
+    };
+
+    typedef std::vector<Node, AlignedAllocator<Node, 32>> NodeArray;
+
+    // What the tree is built from: the bounds of a shape (or of a triangle of
+    // a mesh), the point by which it is sorted, and its index
+    struct Primitive
+    {
+      BBox bbox;
+      Vec3d center;
+      uint32_t index;
+    };
+
+    // Builds the tree of shapes on all the hardware threads, and reports the
+    // time it took
+    void buildTree(const std::vector<Shape*>& shapes);
+
+    // Builds the tree of prims, and reorders prims in the order of the
+    // leaves: the leaves then hold ranges of this order. No shapes are
+    // stored, which is how the tree of a Mesh is built.
+    void buildTree(std::vector<Primitive>& prims);
+
+    // Packs the triangles of mesh, which must be in the order of the leaves,
+    // into a TriangleBlock, which is then used to intersect the leaves.
+    inline void packTriangles(const Mesh& mesh);
 
-    BBox sBuildTree(const std::vector<Shape*>& shapes, int depth);
+    // Appends the subtree holding the primitives [begin, end[ of prims to
+    // nodes, and returns the index of its root, which is at depth in the
+    // tree. The range is partitioned in place between the children. If pool
+    // is set, the right children of the subtrees larger than
+    // KDTREE_PARALLEL_MIN are built by other tasks.
+    uint32_t sBuildTree(std::vector<Primitive>& prims, uint32_t begin,
+                        uint32_t end, NodeArray& nodes, ThreadPool* pool,
+                        unsigned int depth = 0);
 
-    double findBestSplit(const std::vector<Shape*> shapes, unsigned int& shape_i, int dim);
+    // Evaluates the splits between the bins of the centers (bounds) of the
+    // primitives [begin, end[ on the three axes. Sets cost to the best sum,
+    // over both children, of their surface area times their number of
+    // primitives, and dim and bin to the axis of this split and to the last
+    // bin going to the left child. Returns false, without setting them, if
+    // the centers can not be split.
+    static bool findBestSplit(const std::vector<Primitive>& prims,
+                              uint32_t begin, uint32_t end,
+                              const BBox& bounds, int& dim, int& bin,
+                              double& cost);
 
-    inline bool interLeft(const Shape* s, const Vec3d& split, int dim) const;
+    // Sets hit to the closest hit of r, and returns false if there is none.
+    // The shape of hit is set for a tree of shapes, its primitive for the
+    // tree of a mesh; completing it is left to the caller.
+    inline bool intersect(const Ray& r, Hit& hit) const;
 
-    inline bool interRight(const Shape* s, const Vec3d& split, int dim) const;
+    // Looks for a hit closer than hit.dist in the subtree of node. The
+    // children are visited front to back, and a node is skipped when the ray
+    // enters its box further than the closest hit found so far. If a closer
+    // hit is found, hit is updated and the position in the order of the
+    // leaves of the shape (or of the triangle of the mesh) hit is returned;
+    // otherwise -1 is returned.
+    // The traversal is a loop over a stack of KDTREE_STACK_SIZE nodes. The
+    // instances of meshes met in the leaves are traversed by the same loop,
+    // their nodes being pushed on the same stack; the primitive of hit is
+    // then the triangle of the instance hit.
+    int traverse(uint32_t node, const Ray& r, Hit& hit) const;
 
-    Shape* intersect(const Ray& r, Vec3d& intersect, double& dist) const;
+    // Returns true if any shape is hit by r closer than max_dist. Stops at the
+    // first hit found, which does not have to be the closest one.
+    inline bool occluded(const Ray& r, double max_dist) const;
 
-    inline Shape* findSurroundingShape(const Vec3d& pt) const;
+    bool traverseOccluded(uint32_t node, const Ray& r, double max_dist) const;
 
-    Shape* recFindSurroundingShape(const Vec3d& pt, char dim) const;
+    // Packet versions of intersect and occluded. A packet follows the order
+    // of its first active ray, and the lanes still active when too few of
+    // them reach a node go on as single rays. recIntersect only sets the
+    // indices of the hits.
+    inline void intersect(const RayPacket& packet, PacketHit& hit) const;
+
+    void recIntersect(uint32_t node, const RayPacket& packet, vmask active,
+                      PacketHit& hit) const;
+
+    inline vmask occluded(const RayPacket& packet, vdouble max_dist) const;
+
+    vmask recOccluded(uint32_t node, const RayPacket& packet, vmask active,
+                      vdouble max_dist) const;
 
     inline BBox getBBox() const;
 
+    // Expected cost of a ray going through the tree, according to the SAH
+    inline double cost() const;
+
+    double recCost(uint32_t node, double root_area) const;
+
   private:
-    Vec3d splitpos_;
-    BBox bbox_;
-    Shape* shape_;
-    KDTree* left_;
-    KDTree* right_;
+    friend class MeshCache;
+
+    // Centroid bounds of the primitives [begin, end[, and bin of a primitive
+    // along the dim axis (0 if the bounds are flat on this axis)
+    static BBox centerBounds(const std::vector<Primitive>& prims,
+                             uint32_t begin, uint32_t end);
+    static int binOf(const Primitive& p, const BBox& bounds, int dim);
+
+    // Near and far children of an inner node for a ray going along dir
+    inline void orderChildren(uint32_t node, double dir,
+                              uint32_t& near, uint32_t& far) const;
+
+    // A node of the stack of the traversals, in this tree if instance is -1,
+    // in the tree of the instance shapes_[instance] otherwise
+    struct StackEntry
+    {
+      uint32_t node;
+      int32_t instance;
+    };
+
+    // Turns nodes[node] into a leaf holding the primitives [begin, end[
+    static void makeLeaf(NodeArray& nodes, uint32_t node, uint32_t begin,
+                         uint32_t end);
+
+    // The nodes point either into the NodeArray built by buildTree, or into
+    // a mapped mesh cache; storage_ keeps them alive
+    const Node* nodes_ = nullptr;
+    uint32_t node_count_ = 0;
+    std::shared_ptr<const void> storage_;
+
+    // The shapes in the order of the leaves, and their instanceTree; empty
+    // for the tree of a mesh
+    std::vector<Shape*> shapes_;
+    std::vector<const KDTree*> instances_;
+
+    // The triangles of the mesh in the order of the leaves, if packTriangles
+    // was called
+    TriangleBlock triangles_;
 };
 
 # include "kdtree.hxx"
@@ -1,29 +1,58 @@
 #ifndef KDTREE_HXX_
 # define KDTREE_HXX_
 
-void KDTree::buildTree(const std::vector<Shape*>& shapes)
+void KDTree::packTriangles(const Mesh& mesh)
 {
-    bbox_ = sBuildTree(shapes, 0);
+    triangles_.build(mesh);
 }
 
-bool KDTree::interLeft(const Shape* s, const Vec3d& split, int dim) const
+bool KDTree::intersect(const Ray& r, Hit& hit) const
 {
-    return s->center()[dim] < split[dim];
+    hit = Hit();
+    return traverse(0, r, hit) >= 0;
 }
 
-bool KDTree::interRight(const Shape* s, const Vec3d& split, int dim) const
+bool KDTree::occluded(const Ray& r, double max_dist) const
 {
-    return s->center()[dim] >= split[dim];
+    return traverseOccluded(0, r, max_dist);
 }
 
-Shape* KDTree::findSurroundingShape(const Vec3d& pt) const
+void KDTree::intersect(const RayPacket& packet, PacketHit& hit) const
 {
-    return recFindSurroundingShape(pt, 0);
+    hit.dist = splat(std::numeric_limits<double>::infinity());
+    for (int i = 0; i < PACKET_SIZE; i++)
+    {
+        hit.index[i] = -1;
+        hit.primitive[i] = -1;
+    }
+    recIntersect(0, packet, packet.active, hit);
+    for (int i = 0; i < PACKET_SIZE; i++)
+        hit.shape[i] = (hit.index[i] < 0 ? nullptr : shapes_[hit.index[i]]);
+}
+
+vmask KDTree::occluded(const RayPacket& packet, vdouble max_dist) const
+{
+    return recOccluded(0, packet, packet.active, max_dist);
+}
+
+void KDTree::orderChildren(uint32_t node, double dir,
+                           uint32_t& near, uint32_t& far) const
+{
+    // The left child holds the lowest centers along the split axis
+    near = node + 1;
+    far = nodes_[node].offset;
+    if (dir < 0)
+        std::swap(near, far);
 }
 
 BBox KDTree::getBBox() const
 {
-    return bbox_;
+    return BBox(nodes_[0].bbox);
+}
+
+double KDTree::cost() const
+{
+    return recCost(0, nodes_[0].bbox.surfaceArea());
 }
 
 #endif //!KDTREE_HXX_
@@ -6,6 +6,7 @@
 // to make soft shadows ?
 
 #include "shape.hh"
+#include "hit.hh"
 #include "kdtree.hh"
 #include "vector.hh"
 #include <tinyxml2.h>
@@ -35,36 +36,59 @@ class Light
 
     Color getColor(void) {return color_;}
 
-    Color illumination(Shape& shape, Ray& ray, Vec3d intersection, KDTree& shapes)
+    // The ray going from the light point from to intersection. A shape hit by
+    // this ray closer than max_dist shadows intersection.
+    static Ray lightRay(Vec3d from, Vec3d intersection, double& max_dist)
     {
+      const double shift = std::numeric_limits<double>::epsilon() * 2048;
+      max_dist = (from - intersection).norm() - shift;
+      return Ray(from, normalize(intersection - from));
+    }
+
+    // The light ray of the first sample, which starts from the center of the
+    // light
+    Ray lightRay(Vec3d intersection, double& max_dist) const
+    {
+      return lightRay(orig_, intersection, max_dist);
+    }
+
+    // If the occlusion of the first light ray is already known (0 or 1, for
+    // instance from a packet of shadow rays), it is given as first_shadow;
+    // -1 otherwise. Unless soft is set, only the first light ray is traced.
+    // footprint is the width of the surface seen through a pixel at the
+    // hit, see Shape::getColorAt.
+    Color illumination(const Hit& hit, Ray& ray, KDTree& shapes,
+                       int first_shadow = -1, bool soft = true,
+                       double footprint = 0)
+    {
+      const Shape& shape = *hit.shape;
+      Vec3d intersection = hit.point;
       Vec3d cur_orig = orig_;
       Color total_color (0,0,0,0);
 
+      // The intersection is the same for every sample
+      Color surface_color = shape.getColorAt(hit, footprint);
+
       int max = samples_;
-      for (int i = 0; i < max * max + 1; i++)
+      int count = (soft ? max * max + 1 : 1);
+      for (int i = 0; i < count; i++)
       {
-        Vec3d dir_light = normalize(intersection - cur_orig);
-        double light_dist = (cur_orig - intersection).norm();
+        double max_dist;
+        Ray light_ray = lightRay(cur_orig, intersection, max_dist);
+        Vec3d dir_light = light_ray.dir();
         double shadowed = 0.0;
-        Ray light_ray (cur_orig , dir_light);
-        const double shift = std::numeric_limits<double>::epsilon() * 2048;
-        Ray shadow_ray (intersection + shift * dir_light, -dir_light);
-
-        // If this ray hits a shape, it shadowed.
-        Vec3d hit;
-        double dist;
 
-        if (shapes.intersect(light_ray, hit, dist))
-        {
-          if (dist + shift < light_dist)
-            shadowed = 1;
-        }
+        // If this ray hits a shape before the intersection, it is shadowed.
+        if (i == 0 && first_shadow >= 0)
+          shadowed = first_shadow;
+        else if (shapes.occluded(light_ray, max_dist))
+          shadowed = 1;
         //shadowed = 0;
 
         const Material& mat = shape.getMaterial();
-        double diffcoef = mat.get_diffuse_coef() * clamp_zero(shape.normal(shadow_ray).dot(-light_ray.dir()) - shadowed);
+        double diffcoef = mat.get_diffuse_coef() * clamp_zero(hit.normalAlong(-dir_light).dot(-dir_light) - shadowed);
 
-        Ray refl_light = shape.reflect(shadow_ray.op_dir());
+        Ray refl_light = hit.reflect(dir_light);
         double phong = (diffcoef <= 0 ? 0
             : mat.get_specular_coef() * clamp_zero(refl_light.dir().dot(normalize(ray.orig() - intersection))));
 
@@ -73,7 +97,7 @@ class Light
             mat.color_at(0,0);
             // */
             //*
-            shape.getColorAt(intersection);
+            surface_color;
             // */
 
         Color dcolor = diffcoef * mat.get_diffuse_coef() *
@@ -81,7 +105,7 @@ class Light
             mat.color_at(0,0);
             // */
             //*
-            shape.getColorAt(intersection);
+            surface_color;
             // */
 
         Color scolor = pow(phong, mat.get_brilliancy()) * Color(1,1,1);
@@ -89,7 +113,7 @@ class Light
         total_color  = total_color + satSum(satSum(acolor, dcolor), scolor);
 
         // Normal debug
-        //Vec3d normal = shape.normal(shadow_ray);
+        //Vec3d normal = hit.normalAlong(-dir_light);
         //total_color = Color(fabs(normal[0]), fabs(normal[1]), fabs(normal[2]));
 
         if (samples_ != 0)
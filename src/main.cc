@@ -1,22 +1,53 @@
 #include <iostream>
 #include <fstream>
+#include <climits>
 #include <stdlib.h>
+#include <string>
 #include "scene.hh"
 #include "camera.hh"
 
 void usage(char* pname)
 {
-  std::cout << "Usage: " << pname << " source.xml result.img x y" << std::endl;
+  std::cout << "Usage: " << pname << " source.xml result.img x y [options]" << std::endl;
   std::cout << "  source.xml: file describing the scene" << std::endl;
   std::cout << "  result.img: file containing the result" << std::endl;
   std::cout << "  x and y   : dimensions of the generated image" << std::endl;
+  std::cout << "Options:" << std::endl;
+  std::cout << "  -t n      : number of render threads (default 1, 0 for all cores)" << std::endl;
+  std::cout << "  -p        : trace primary and shadow rays by packets" << std::endl;
+  std::cout << "  -g        : progressive rendering, the partial image is saved to result.img" << std::endl;
+  std::cout << "  -i s      : seconds between two partial saves (default " << PROGRESSIVE_INTERVAL << ")" << std::endl;
+  std::cout << "  -s n      : maximum samples per pixel for anti-aliasing (default " << AA_SAMPLES << ", 1 to disable)" << std::endl;
+  std::cout << "  -a t      : color difference between neighbour pixels triggering anti-aliasing (default " << AA_THRESHOLD << ")" << std::endl;
 }
 
 Scene& parse(std::fstream& stream);
 
+// Reads the value of an option into out, which is left unchanged if arg is not
+// a whole number (or a number for a double) at least equal to min
+static bool parse_value(const char* arg, unsigned int min, unsigned int& out)
+{
+  char* end;
+  long val = strtol(arg, &end, 10);
+  if (end == arg || *end != '\0' || val < min || val > UINT_MAX)
+    return false;
+  out = val;
+  return true;
+}
+
+static bool parse_value(const char* arg, double min, double& out)
+{
+  char* end;
+  double val = strtod(arg, &end);
+  if (end == arg || *end != '\0' || val < min)
+    return false;
+  out = val;
+  return true;
+}
+
 int main(int argc, char** argv)
 {
-  if (argc != 5)
+  if (argc < 5)
   {
     usage(argv[0]);
     return 1;
@@ -24,12 +55,39 @@ int main(int argc, char** argv)
 
   int x_size = atoi(argv[3]);
   int y_size = atoi(argv[4]);
-  int realx = SIZE_FACTOR * x_size;
-  int realy = SIZE_FACTOR * y_size;
 
-  Scene* scene = Scene::parse(argv[1], realx, realy);
-  scene->render();
+  RenderOptions options;
+  options.output = argv[2];
+  for (int i = 5; i < argc; i++)
+  {
+    std::string opt = argv[i];
+    if (opt == "-t" && i + 1 < argc
+        && parse_value(argv[i + 1], 0u, options.threads))
+      i++;
+    else if (opt == "-p")
+      options.packets = true;
+    else if (opt == "-g")
+      options.progressive = true;
+    else if (opt == "-i" && i + 1 < argc
+             && parse_value(argv[i + 1], 0., options.save_interval))
+      i++;
+    else if (opt == "-s" && i + 1 < argc
+             && parse_value(argv[i + 1], 1u, options.samples))
+      i++;
+    else if (opt == "-a" && i + 1 < argc
+             && parse_value(argv[i + 1], 0., options.aa_threshold))
+      i++;
+    else
+    {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  Scene* scene = Scene::parse(argv[1], x_size, y_size);
+  scene->render(options);
   scene->save(argv[2]);
+  delete scene;
 
   return 0;
 
@@ -1,5 +1,7 @@
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cmath>
 #include <cstdlib>
 #include <highgui.h>
 #include <limits>
@@ -15,14 +17,89 @@ Material::Material(MaterialFunctor      func,
                    const PhongBundle&   pb,
                    float refl)
     : func_(func),
+      cache_(false),
       ambient_coef_(pb[0]), diffuse_coef_(pb[1]),
       specular_coef_(pb[2]), brilliancy_(pb[3]),
       refl_coef_(refl)
 {
+    // 0 is left for the empty entries of the cache
+    static std::atomic<uint64_t> next_id{1};
+    id_ = next_id++;
+}
+
+Material::Material(std::shared_ptr<const ProceduralTable> table,
+                   const PhongBundle&   pb,
+                   float refl)
+    : Material([table](int x, int y) { return table->at(x, y); }, pb, refl)
+{
+    table_ = table;
 }
 
 Material::~Material() {}
 
+struct TexelCacheEntry
+{
+    uint64_t material;
+    int x;
+    int y;
+    Color color;
+};
+
+Color Material::cached_color_at(int x, int y) const
+{
+    // Every render thread has its own cache, so that no locking is needed
+    static thread_local std::vector<TexelCacheEntry> cache(TEXTURE_CACHE_SIZE);
+
+    uint64_t h = id_ * 0x9e3779b97f4a7c15ULL;
+    h ^= (static_cast<uint64_t>(static_cast<uint32_t>(x)) << 32)
+       | static_cast<uint32_t>(y);
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 32;
+
+    TexelCacheEntry& entry = cache[h & (TEXTURE_CACHE_SIZE - 1)];
+    if (entry.material != id_ || entry.x != x || entry.y != y)
+    {
+        entry.material = id_;
+        entry.x = x;
+        entry.y = y;
+        entry.color = func_(x, y);
+    }
+    return entry.color;
+}
+
+Color Material::filtered_color_at(double x, double y, double footprint) const
+{
+    if (!mip_ || footprint < 2)
+        return color_at(x, y);
+
+    // The level whose texels are as large as the footprint, rounded down
+    int level = std::min(std::ilogb(footprint), mip_->levels() - 1);
+    return mip_->at(static_cast<int>(std::round(x)),
+                    static_cast<int>(std::round(y)), level);
+}
+
+ProceduralTable::ProceduralTable(unsigned width, unsigned height, bool repeat,
+                                 std::vector<Color> palette)
+    : width_(width), height_(height), repeat_(repeat),
+      index_(width * height, NONE), palette_(std::move(palette))
+{
+    assert(width > 0 && height > 0 && palette_.size() < NONE);
+}
+
+void ProceduralTable::set(unsigned x, unsigned y, uint16_t index)
+{
+    assert(x < width_ && y < height_ && (index == NONE || index < palette_.size()));
+    index_[y * width_ + x] = index;
+}
+
+void ProceduralTable::unmatched(int x, int y) const
+{
+    std::cerr << "Nooo! Can't handle (" << x << "; " << y << ") "
+        << "(transformed into (" << wrap(x, width_, repeat_) << "; "
+        << wrap(y, height_, repeat_) << "))" << std:: endl;
+    std::exit(33);
+}
+
 const MaterialFunctor& Material::get_functor() const
 {
     return func_;
@@ -289,9 +366,79 @@ _makeProceduralFunctor_noRepeat(std::vector<ICC>& constraints, Color base)
     }
 }
 
-// warning: removes elements from the given vector
+// Index of the first constraint matching (x, y), or -1
+static int matchConstraint(const std::vector<ICC>& constraints,
+                           unsigned x, unsigned y)
+{
+    for (size_t i = 0; i < constraints.size(); i++)
+    {
+        const ICC& c = constraints[i];
+        if ((!c.xconstrained || (x >= c.xfrom && x <= c.xto))
+            && (!c.yconstrained || (y >= c.yfrom && y <= c.yto)))
+            return i;
+    }
+    return -1;
+}
+
+// The colors given by the functors above, computed once: over the period of
+// the material if it repeats, otherwise up to the first coordinates past all
+// the constraints, which give the base color as any further ones. Returns
+// nullptr if the table would have more than PROCEDURAL_TABLE_MAX cells.
+static std::shared_ptr<const ProceduralTable>
+makeProceduralTable(const std::vector<ICC>& constraints, bool repeat,
+                    const Color* base)
+{
+    unsigned xmax = 0;
+    unsigned ymax = 0;
+    bool xconstrained = false;
+    bool yconstrained = false;
+    for (const ICC& c: constraints)
+    {
+        if (c.xconstrained)
+        {
+            xconstrained = true;
+            xmax = std::max(xmax, c.xto);
+        }
+        if (c.yconstrained)
+        {
+            yconstrained = true;
+            ymax = std::max(ymax, c.yto);
+        }
+    }
+
+    uint64_t width = (!xconstrained ? 1 : (repeat ? xmax : xmax + uint64_t(2)));
+    uint64_t height = (!yconstrained ? 1 : (repeat ? ymax : ymax + uint64_t(2)));
+    if (width * height > PROCEDURAL_TABLE_MAX
+        || constraints.size() + 1 >= ProceduralTable::NONE)
+        return nullptr;
+
+    std::vector<Color> palette;
+    for (const ICC& c: constraints)
+        palette.push_back(c.color);
+    if (base)
+        palette.push_back(*base);
+
+    auto table = std::make_shared<ProceduralTable>(width, height, repeat,
+                                                   std::move(palette));
+    for (unsigned y = 0; y < height; y++)
+        for (unsigned x = 0; x < width; x++)
+        {
+            int index = matchConstraint(constraints, x, y);
+            if (index >= 0)
+                table->set(x, y, index);
+            else if (base)
+                table->set(x, y, constraints.size());
+        }
+
+    return table;
+}
+
+// warning: removes elements from the given vector. Sets table to the
+// precomputed colors of the material, if they fit in PROCEDURAL_TABLE_MAX
+// cells.
 static std::function<Color(int,int)>
-makeProceduralFunctor(std::vector<ICC>& constraints, bool repeat)
+makeProceduralFunctor(std::vector<ICC>& constraints, bool repeat,
+                      std::shared_ptr<const ProceduralTable>& table)
 {
     assert(constraints.size() > 0);
 
@@ -306,6 +453,7 @@ makeProceduralFunctor(std::vector<ICC>& constraints, bool repeat)
         Color color{ibase->color};
         std::remove_if(constraints.begin(), constraints.end(),
                        [](const ICC& c){ return !c.xconstrained && !c.yconstrained; });
+        table = makeProceduralTable(constraints, repeat, &color);
         if (repeat)
             return _makeProceduralFunctor_repeat_withBase(constraints, color);
         else
@@ -317,11 +465,13 @@ makeProceduralFunctor(std::vector<ICC>& constraints, bool repeat)
                    "can't create a non-repetitive procedural texture "
                    "without a base color "
                    "(having no where_x nor where_y clauses)");
-        return _makeProceduralFunctor_repeat_noBase(constraints);
+        auto functor = _makeProceduralFunctor_repeat_noBase(constraints);
+        table = makeProceduralTable(constraints, repeat, nullptr);
+        return functor;
     }
 }
 
-Material* Material::parse(tinyxml2::XMLNode* node)
+Material* Material::parse(tinyxml2::XMLNode* node, Arena& arena)
 {
   tinyxml2::XMLElement* elt = node->ToElement();
 
@@ -337,6 +487,9 @@ Material* Material::parse(tinyxml2::XMLNode* node)
   elt->QueryFloatAttribute("brilliancy", &brilliancy);
   elt->QueryFloatAttribute("refl", &refl);
 
+  Material* res = nullptr;
+  bool cache = false;
+
   PARSE_ERROR_IF(isnan(ambient) || isnan(diffuse) || isnan(specular) || isnan(brilliancy),
                  "missing attribute for material");
 
@@ -346,7 +499,7 @@ Material* Material::parse(tinyxml2::XMLNode* node)
     tinyxml2::XMLElement* child_elt = node->FirstChild()->ToElement();
     Color c = Color::parse(child_elt);
     std::function<Color(int,int)> fn = [c](int,int) {return c;};
-    return new Material(fn, PhongBundle{{ambient, diffuse, specular, brilliancy}}, refl);
+    res = arena.make<Material>(fn, PhongBundle{{ambient, diffuse, specular, brilliancy}}, refl);
   }
   else if (elt->Attribute("type", "procedural"))
   {
@@ -361,11 +514,19 @@ Material* Material::parse(tinyxml2::XMLNode* node)
       bool repeat = elt->Attribute("repeat")
                  && std::strcmp(elt->Attribute("repeat"), "0") != 0;
 
-      return new Material{
-          makeProceduralFunctor(constraints, repeat),
-          PhongBundle{{ambient, diffuse, specular, brilliancy}},
-          refl
-      };
+      std::shared_ptr<const ProceduralTable> table;
+      MaterialFunctor fn = makeProceduralFunctor(constraints, repeat, table);
+      PhongBundle pb{{ambient, diffuse, specular, brilliancy}};
+
+      // Looking for the matching constraint is slower than a cache lookup,
+      // but a table lookup is faster than both
+      if (table)
+          res = arena.make<Material>(table, pb, refl);
+      else
+      {
+          res = arena.make<Material>(fn, pb, refl);
+          cache = true;
+      }
   }
   else if (elt->Attribute("type", "bitmap"))
   {
@@ -382,12 +543,15 @@ Material* Material::parse(tinyxml2::XMLNode* node)
       tinyxml2::XMLElement* child_elt = node->FirstChildElement("image");
       PARSE_ERROR_IF(child_elt == nullptr,
                      "missing image node for bitmap material");
-      return new BitmapTexture{
-          cv::imread(child_elt->GetText()),
+      cv::Mat image = cv::imread(child_elt->GetText());
+      PARSE_ERROR_IF(image.empty(),
+                     "cannot read image " << child_elt->GetText());
+      res = arena.make<BitmapTexture>(
+          image,
           PhongBundle{{ambient, diffuse, specular, brilliancy}},
           refl,
           trans
-      };
+      );
   }
   else
   {
@@ -395,4 +559,10 @@ Material* Material::parse(tinyxml2::XMLNode* node)
     exit(1);
   }
 
+  // The cache attribute overrides the default of the type
+  if (const char* cache_attr = elt->Attribute("cache"))
+    cache = std::strcmp(cache_attr, "0") != 0;
+  res->set_cache(cache);
+  return res;
+
 }
@@ -3,6 +3,10 @@
 
 # include <functional>
 # include <array>
+# include <cstdint>
+# include <memory>
+# include <vector>
+# include "arena.hh"
 # include "color.hh"
 # include "vector.hh"
 
@@ -23,12 +27,63 @@ using MaterialFunctor = std::function<Color(int, int)>;
  */
 using PhongBundle = std::array<float, 4>;
 
+/**
+ * Number of entries (a power of two) of the per-thread texel cache, see
+ * Material::set_cache. An entry takes 48 bytes.
+ */
+# define TEXTURE_CACHE_SIZE 4096
+
+/**
+ * Maximum number of cells of the lookup table of a procedural material. The
+ * materials needing a bigger one look for their matching constraint on every
+ * call instead.
+ */
+# define PROCEDURAL_TABLE_MAX (1 << 22)
+
+/**
+ * The colors of a procedural material, computed once over its period (or,
+ * when it does not repeat, over the area where its constraints apply): a dense
+ * width x height table of indices in a palette. A lookup wraps (or clamps)
+ * both coordinates and loads one index.
+ */
+class ProceduralTable
+{
+public:
+    /// Index of the cells matching no color
+    static const uint16_t NONE = 0xffff;
+
+    ProceduralTable(unsigned width, unsigned height, bool repeat,
+                    std::vector<Color> palette);
+
+    void set(unsigned x, unsigned y, uint16_t index);
+
+    inline Color at(int x, int y) const;
+
+private:
+    inline static unsigned wrap(int coord, unsigned size, bool repeat);
+
+    [[noreturn]] void unmatched(int x, int y) const;
+
+    unsigned width_;
+    unsigned height_;
+    bool repeat_;
+    std::vector<uint16_t> index_;
+    std::vector<Color> palette_;
+};
+
+class MipTexture;
+
 class Material
 {
 public:
     Material(MaterialFunctor, const PhongBundle&, float refl);
 
-    static Material* parse(tinyxml2::XMLNode* node);
+    /// A Material whose colors are looked up in table
+    Material(std::shared_ptr<const ProceduralTable> table,
+             const PhongBundle&, float refl);
+
+    /// Parses a material, allocated in arena
+    static Material* parse(tinyxml2::XMLNode* node, Arena& arena);
 
     virtual ~Material();
 
@@ -46,14 +101,45 @@ public:
     inline void set_brilliancy(float);
     void        set_phongbundle(const PhongBundle&);
 
+    /**
+     * When set, the colors returned by the functor are kept in a
+     * direct-mapped cache of TEXTURE_CACHE_SIZE texels per render thread,
+     * shared by the copies of this Material. It is only worth it when the
+     * functor is more expensive than a lookup.
+     */
+    inline void set_cache(bool);
+
     const MaterialFunctor& get_functor() const;
 
     inline Color color_at(int x, int y) const;
     inline Color color_at(double x, double y) const;
 
+    /**
+     * Color at (x, y) when about footprint units of the material are seen
+     * through one pixel of the image. Bitmap textures use it to pick a level
+     * of their mip chain; the other materials ignore it.
+     */
+    Color filtered_color_at(double x, double y, double footprint) const;
+
+    /// Whether filtered_color_at uses the footprint, so that it is worth
+    /// computing
+    inline bool is_filtered() const;
+
 protected:
+    Color cached_color_at(int x, int y) const;
+
     const MaterialFunctor func_;
 
+    /// Set for the procedural materials, which then do not use func_
+    std::shared_ptr<const ProceduralTable> table_;
+
+    /// Set for the bitmap textures, whose func_ reads its first level
+    std::shared_ptr<const MipTexture> mip_;
+
+    /// Identifies the texels of this Material (and of its copies) in the cache
+    uint64_t id_;
+    bool cache_;
+
     /// Illumination coefficients
     float ambient_coef_;
     float diffuse_coef_;
@@ -1,6 +1,7 @@
 #ifndef MATERIAL_HXX
 # define MATERIAL_HXX
 
+# include <algorithm>
 # include <cassert>
 # include <cmath>
 # include "material.hh"
@@ -32,6 +33,11 @@ float Material::get_refl() const
   return refl_coef_;
 }
 
+bool Material::is_filtered() const
+{
+    return mip_ != nullptr;
+}
+
 /* SETTERS */
 
 void Material::set_ambient_coef(float coef)
@@ -58,17 +64,45 @@ void Material::set_brilliancy(float coef)
     brilliancy_ = coef;
 }
 
+void Material::set_cache(bool cache)
+{
+    cache_ = cache;
+}
+
 /* COMPUTE THE COLOR */
 
+unsigned ProceduralTable::wrap(int coord, unsigned size, bool repeat)
+{
+    if (repeat)
+    {
+        int res = coord % static_cast<int>(size);
+        return (res < 0 ? res + size : res);
+    }
+    return (coord < 0 ? 0 : std::min(static_cast<unsigned>(coord), size - 1));
+}
+
+Color ProceduralTable::at(int x, int y) const
+{
+    uint16_t index = index_[wrap(y, height_, repeat_) * width_
+                            + wrap(x, width_, repeat_)];
+    if (index == NONE)
+        unmatched(x, y);
+    return palette_[index];
+}
+
 Color Material::color_at(int x, int y) const
 {
+    if (table_)
+        return table_->at(x, y);
+    if (cache_)
+        return cached_color_at(x, y);
     return func_(x, y);
 }
 
 Color Material::color_at(double x, double y) const
 {
-    return func_(static_cast<int>(std::round(x)),
-                 static_cast<int>(std::round(y)));
+    return color_at(static_cast<int>(std::round(x)),
+                    static_cast<int>(std::round(y)));
 }
 
 #endif // !MATERIAL_HXX
@@ -0,0 +1,174 @@
+#include "mesh.hh"
+#include "thread_pool.hh"
+#include "utils.hh"
+#include <algorithm>
+
+// The buffers of a mesh which was not read from a cache
+struct MeshBuffers
+{
+  std::vector<float> positions;
+  std::vector<float> normals;
+  std::vector<uint32_t> indices;
+};
+
+Mesh::Mesh(std::vector<float> positions,
+           std::vector<float> normals,
+           std::vector<uint32_t> indices)
+{
+  std::shared_ptr<MeshBuffers> buffers = std::make_shared<MeshBuffers>();
+  buffers->positions.swap(positions);
+  buffers->normals.swap(normals);
+  vertices_ = buffers->positions.size() / 3;
+  size_ = indices.size() / 3;
+  positions_ = buffers->positions.data();
+  indices_ = indices.data();
+
+  std::vector<KDTree::Primitive> prims(size_);
+  for (uint32_t t = 0; t < size_; t++)
+  {
+    Vec3d pt1 = vertex(t, 0);
+    Vec3d pt2 = vertex(t, 1);
+    Vec3d pt3 = vertex(t, 2);
+    prims[t].bbox = BBox(minVec(minVec(pt1, pt2), pt3),
+                         maxVec(maxVec(pt1, pt2), pt3));
+    prims[t].center = (1./3.) * (pt1 + pt2 + pt3);
+    prims[t].index = t;
+  }
+
+  tree_.buildTree(prims);
+
+  // The triangles are stored in the order of the leaves
+  buffers->indices.resize(indices.size());
+  for (uint32_t t = 0; t < size_; t++)
+    for (int v = 0; v < 3; v++)
+      buffers->indices[3 * t + v] = indices[3 * prims[t].index + v];
+
+  indices_ = buffers->indices.data();
+  normals_ = (buffers->normals.empty() ? nullptr : buffers->normals.data());
+  storage_ = buffers;
+
+  tree_.packTriangles(*this);
+}
+
+std::vector<Vec3d> Mesh::smoothNormals(const std::vector<Vec3d>& faces,
+                                       const std::vector<uint32_t>& indices,
+                                       uint32_t vertices)
+{
+  // The triangles around each vertex, in their order: those of the vertex v
+  // are around[first[v]] to around[first[v + 1] - 1]
+  std::vector<uint32_t> first(vertices + 1, 0);
+  for (unsigned int i = 0; i < indices.size(); i++)
+    first[indices[i] + 1]++;
+  for (uint32_t v = 0; v < vertices; v++)
+    first[v + 1] += first[v];
+
+  std::vector<uint32_t> around(indices.size());
+  std::vector<uint32_t> next(first.begin(), first.end() - 1);
+  for (unsigned int i = 0; i < indices.size(); i++)
+    around[next[indices[i]]++] = i / 3;
+
+  std::vector<Vec3d> normals(vertices, Vec3d(0, 0, 0));
+  auto average = [&](uint32_t begin, uint32_t end)
+  {
+    for (uint32_t v = begin; v < end; v++)
+    {
+      // The normals of the triangles do not have a consistent orientation:
+      // each one is flipped to face the same side as their sum so far
+      Vec3d pt = Vec3d(0,0,0);
+      int total = first[v + 1] - first[v];
+      if (total == 0)
+        continue;
+
+      for (uint32_t i = first[v]; i < first[v + 1]; i++)
+      {
+        const Vec3d& curNormal = faces[around[i]];
+        if (curNormal.dot(pt) < 0)
+          pt = pt - curNormal;
+        else
+          pt = pt + curNormal;
+      }
+      pt = (1./((double) total)) * pt;
+
+      normals[v] = normalize(pt);
+    }
+  };
+
+  if (vertices <= MESH_SMOOTH_CHUNK)
+    average(0, vertices);
+  else
+  {
+    ThreadPool pool(0);
+    for (uint32_t v = 0; v < vertices; v += MESH_SMOOTH_CHUNK)
+    {
+      uint32_t end = std::min<uint32_t>(v + MESH_SMOOTH_CHUNK, vertices);
+      pool.push([&average, v, end] {average(v, end);});
+    }
+    pool.wait();
+  }
+
+  return normals;
+}
+
+bool Mesh::intersect(uint32_t t, const Ray& ray, double& dist) const
+{
+  Vec3d pt1 = vertex(t, 0);
+  Vec3d e1 = vertex(t, 1) - pt1;
+  Vec3d e2 = vertex(t, 2) - pt1;
+
+  Vec3d p = ray.dir().cross(e2);
+  double det = e1.dot(p);
+  double inv_det = 1. / det;
+
+  Vec3d o = ray.orig() - pt1;
+
+  double u = o.dot(p) * inv_det;
+  if (u < 0 || u > 1)
+    return false;
+
+  Vec3d q = o.cross(e1);
+  double v = ray.dir().dot(q) * inv_det;
+  if (v < 0 || u + v > 1)
+    return false;
+
+  dist = e2.dot(q) * inv_det;
+  return dist >= 0.;
+}
+
+void Mesh::barycentric(uint32_t t, const Ray& ray, double& u, double& v) const
+{
+  Vec3d pt1 = vertex(t, 0);
+  Vec3d e1 = vertex(t, 1) - pt1;
+  Vec3d e2 = vertex(t, 2) - pt1;
+
+  Vec3d p = ray.dir().cross(e2);
+  double inv_det = 1. / e1.dot(p);
+  Vec3d o = ray.orig() - pt1;
+  u = o.dot(p) * inv_det;
+  v = ray.dir().dot(o.cross(e1)) * inv_det;
+}
+
+Vec3d Mesh::normal(uint32_t t, double u, double v) const
+{
+  if (!normals_)
+    return faceNormal(t);
+
+  const float* no1 = normals_ + 3 * indices_[3 * t];
+  const float* no2 = normals_ + 3 * indices_[3 * t + 1];
+  const float* no3 = normals_ + 3 * indices_[3 * t + 2];
+  return Vec3d(no1[0], no1[1], no1[2]) * (1 - u - v)
+       + Vec3d(no2[0], no2[1], no2[2]) * u
+       + Vec3d(no3[0], no3[1], no3[2]) * v;
+}
+
+void Mesh::textureCoords(uint32_t t, const Vec3d& pt, double& x, double& y) const
+{
+  // The texture starts at the first vertex and its x axis follows the first
+  // edge
+  Vec3d pt1 = vertex(t, 0);
+  Vec3d tex_x = normalize(vertex(t, 1) - pt1);
+  Vec3d tex_y = faceNormal(t).cross(tex_x);
+
+  Vec3d d = pt - pt1;
+  x = d.dot(tex_x);
+  y = d.dot(tex_y);
+}
@@ -0,0 +1,95 @@
+#ifndef MESH_HH_
+# define MESH_HH_
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "kdtree.hh"
+#include "ray.hh"
+#include "vector.hh"
+
+// Vertices whose normals are averaged by the same task in smoothNormals
+#define MESH_SMOOTH_CHUNK 16384
+
+class MeshCache;
+
+// The triangles of an obj file, stored as a buffer of vertices, the normals
+// of the vertices if they are interpolated, and the three indices of the
+// vertices of every triangle. The triangles are numbered in the order of the
+// leaves of their KDTree, which intersects them through a TriangleBlock.
+// They have no material: it is the one of the Obj using the mesh.
+class Mesh
+{
+  public:
+    // positions holds the three coordinates of every vertex, normals the
+    // normal of every vertex or nothing, and indices the three vertices of
+    // every triangle. The triangles are reordered while their tree is built.
+    Mesh(std::vector<float> positions,
+         std::vector<float> normals,
+         std::vector<uint32_t> indices);
+
+    Mesh(const Mesh&) = delete;
+    Mesh& operator=(const Mesh&) = delete;
+
+    // Normal of every vertex of the triangles given by indices, as indices in
+    // [0, vertices[: the average of the normals of the triangles around it.
+    // The vertices are shared out between the hardware threads.
+    static std::vector<Vec3d> smoothNormals(const std::vector<Vec3d>& faces,
+                                            const std::vector<uint32_t>& indices,
+                                            uint32_t vertices);
+
+    const KDTree& tree() const {return tree_;}
+
+    uint32_t size() const {return size_;}
+
+    bool interpolated() const {return normals_ != nullptr;}
+
+    // The vertex v (0, 1 or 2) of the triangle t
+    Vec3d vertex(uint32_t t, int v) const
+    {
+      const float* pt = positions_ + 3 * indices_[3 * t + v];
+      return Vec3d(pt[0], pt[1], pt[2]);
+    }
+
+    // Normal of the plane of the triangle t
+    Vec3d faceNormal(uint32_t t) const
+    {
+      Vec3d pt1 = vertex(t, 0);
+      Vec3d pt2 = vertex(t, 1);
+      Vec3d pt3 = vertex(t, 2);
+      return normalize((pt3 - pt2).cross(pt1 - pt3));
+    }
+
+    // Same as Triangle::intersect, with the triangle t
+    bool intersect(uint32_t t, const Ray& ray, double& dist) const;
+
+    // Barycentric coordinates in the triangle t of the point where ray hits
+    // its plane: the weights of its second and third vertices
+    void barycentric(uint32_t t, const Ray& ray, double& u, double& v) const;
+
+    // Normal of the triangle t at the point of barycentric coordinates u and
+    // v, interpolated between the normals of its vertices if there are any
+    Vec3d normal(uint32_t t, double u, double v) const;
+
+    // Same as Triangle::textureCoords, with the triangle t
+    void textureCoords(uint32_t t, const Vec3d& pt, double& x, double& y) const;
+
+  private:
+    friend class MeshCache;
+
+    Mesh() {}
+
+    uint32_t vertices_ = 0;
+    uint32_t size_ = 0;
+
+    // The buffers point either into the vectors given to the constructor, or
+    // into a mapped mesh cache; storage_ keeps them alive
+    const float* positions_ = nullptr;
+    const float* normals_ = nullptr;
+    const uint32_t* indices_ = nullptr;
+    std::shared_ptr<const void> storage_;
+
+    KDTree tree_;
+};
+
+#endif
@@ -0,0 +1,191 @@
+#include "mesh_cache.hh"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const std::string& path)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return;
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+  {
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED)
+    {
+      data_ = data;
+      size_ = st.st_size;
+    }
+  }
+  close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+  if (data_)
+    munmap(data_, size_);
+}
+
+// The sections of a cache file start on this boundary, so that they can be
+// used in place
+#define MESH_CACHE_ALIGN 64
+
+struct MeshCache::Header
+{
+  char magic[8];
+  uint32_t version;
+  // sizeof (accel_t) and sizeof (KDTree::Node) of the program which wrote
+  // the file
+  uint32_t accel_size;
+  uint32_t node_size;
+  uint32_t interp;
+  uint64_t hash;
+  uint32_t vertices;
+  uint32_t triangles;
+  uint32_t nodes;
+};
+
+static const char magic[8] = {'C', 'R', 'A', 'Y', 'M', 'E', 'S', 'H'};
+
+// Offsets of the sections of a cache file: the vertices, their normals if
+// they are interpolated, the indices of the triangles, the nodes and the
+// triangle block
+struct MeshCache::Layout
+{
+  Layout(const Header& header)
+  {
+    positions = align(sizeof (Header));
+    normals = align(positions + header.vertices * 3 * sizeof (float));
+    indices = align(normals + (header.interp ? header.vertices * 3 * sizeof (float) : 0));
+    nodes = align(indices + header.triangles * 3 * sizeof (uint32_t));
+    block = align(nodes + header.nodes * sizeof (KDTree::Node));
+    size = block + 9 * TriangleBlock::stride(header.triangles) * sizeof (accel_t);
+  }
+
+  static size_t align(size_t offset)
+  {
+    return (offset + MESH_CACHE_ALIGN - 1) / MESH_CACHE_ALIGN * MESH_CACHE_ALIGN;
+  }
+
+  size_t positions;
+  size_t normals;
+  size_t indices;
+  size_t nodes;
+  size_t block;
+  size_t size;
+};
+
+MeshCache::MeshCache(const char* fname, bool interp)
+  : path_(std::string(fname) + (interp ? ".interp.cache" : ".cache")),
+    interp_(interp)
+{
+  hash_ = hashFile(fname, valid_);
+}
+
+uint64_t MeshCache::hashFile(const char* fname, bool& ok)
+{
+  MappedFile file (fname);
+  ok = file.valid();
+
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < file.size(); i++)
+  {
+    hash ^= static_cast<unsigned char>(file.data()[i]);
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+std::shared_ptr<const Mesh> MeshCache::load() const
+{
+  if (!valid_)
+    return nullptr;
+
+  std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>(path_);
+  if (!file->valid() || file->size() < sizeof (Header))
+    return nullptr;
+
+  const Header* header = reinterpret_cast<const Header*>(file->data());
+  if (memcmp(header->magic, magic, sizeof (magic)) != 0
+      || header->version != MESH_CACHE_VERSION
+      || header->accel_size != sizeof (accel_t)
+      || header->node_size != sizeof (KDTree::Node)
+      || header->interp != interp_
+      || header->hash != hash_)
+    return nullptr;
+
+  Layout layout (*header);
+  if (file->size() < layout.size)
+    return nullptr;
+
+  std::shared_ptr<Mesh> mesh (new Mesh());
+  mesh->vertices_ = header->vertices;
+  mesh->size_ = header->triangles;
+  mesh->positions_ = reinterpret_cast<const float*>(file->data() + layout.positions);
+  if (interp_)
+    mesh->normals_ = reinterpret_cast<const float*>(file->data() + layout.normals);
+  mesh->indices_ = reinterpret_cast<const uint32_t*>(file->data() + layout.indices);
+  mesh->storage_ = file;
+
+  KDTree& tree = mesh->tree_;
+  tree.nodes_ = reinterpret_cast<const KDTree::Node*>(file->data() + layout.nodes);
+  tree.node_count_ = header->nodes;
+  tree.storage_ = file;
+  tree.triangles_.map(reinterpret_cast<const accel_t*>(file->data() + layout.block),
+                      *mesh, file);
+  return mesh;
+}
+
+void MeshCache::save(const Mesh& mesh) const
+{
+  if (!valid_)
+    return;
+
+  Header header;
+  memset(&header, 0, sizeof (header));
+  memcpy(header.magic, magic, sizeof (magic));
+  header.version = MESH_CACHE_VERSION;
+  header.accel_size = sizeof (accel_t);
+  header.node_size = sizeof (KDTree::Node);
+  header.interp = interp_;
+  header.hash = hash_;
+  header.vertices = mesh.vertices_;
+  header.triangles = mesh.size_;
+  header.nodes = mesh.tree_.node_count_;
+  Layout layout (header);
+
+  // The file is written under a temporary name and renamed once complete, so
+  // that an interrupted run never leaves a truncated cache
+  std::string tmp = path_ + ".tmp";
+  std::ofstream out (tmp, std::ios::binary);
+
+  auto write = [&out](size_t offset, const void* data, size_t size)
+  {
+    while (static_cast<size_t>(out.tellp()) < offset)
+      out.put(0);
+    out.write(static_cast<const char*>(data), size);
+  };
+
+  write(0, &header, sizeof (header));
+  write(layout.positions, mesh.positions_, header.vertices * 3 * sizeof (float));
+  if (interp_)
+    write(layout.normals, mesh.normals_, header.vertices * 3 * sizeof (float));
+  write(layout.indices, mesh.indices_, header.triangles * 3 * sizeof (uint32_t));
+  write(layout.nodes, mesh.tree_.nodes_, header.nodes * sizeof (KDTree::Node));
+  write(layout.block, mesh.tree_.triangles_.data(),
+        9 * TriangleBlock::stride(header.triangles) * sizeof (accel_t));
+  out.close();
+
+  if (!out || std::rename(tmp.c_str(), path_.c_str()) != 0)
+  {
+    std::cerr << "Warning: could not write the mesh cache " << path_ << std::endl;
+    std::remove(tmp.c_str());
+  }
+}
@@ -0,0 +1,70 @@
+#ifndef MESH_CACHE_HH_
+# define MESH_CACHE_HH_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "mesh.hh"
+
+// Version of the layout of the cache files, to be increased when it changes
+// or when what they hold is computed differently (version 2 averages the
+// normals around welded vertices, version 3 holds indexed vertex buffers and
+// version 4 bounds the depth of the trees, see KDTREE_MAX_DEPTH)
+#define MESH_CACHE_VERSION 4
+
+// A read only file mapped in memory
+class MappedFile
+{
+  public:
+    // The file is not mapped if it can not be opened or is empty
+    explicit MappedFile(const std::string& path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool valid() const {return data_ != nullptr;}
+    const char* data() const {return static_cast<const char*>(data_);}
+    size_t size() const {return size_;}
+
+  private:
+    void* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// The binary cache of a mesh, written next to its obj file the first time it
+// is loaded. It holds the buffers of the Mesh (vertices, normals if they are
+// interpolated, and indices of the triangles in the order of the leaves), the
+// nodes of its KDTree and its TriangleBlock. A cache is only used if it was
+// written from the same obj file (same hash), with the same interpolation and
+// the same precision of the acceleration structures; the whole mesh is then
+// used in place from the mapped file.
+class MeshCache
+{
+  public:
+    MeshCache(const char* fname, bool interp);
+
+    const std::string& path() const {return path_;}
+
+    // Returns the cached mesh, or nullptr if there is no valid cache
+    std::shared_ptr<const Mesh> load() const;
+
+    // Writes mesh to the cache. Failures are reported but are not fatal.
+    void save(const Mesh& mesh) const;
+
+  private:
+    struct Header;
+    struct Layout;
+
+    // FNV-1a hash of the contents of a file; sets ok to false if the file
+    // can not be read
+    static uint64_t hashFile(const char* fname, bool& ok);
+
+    std::string path_;
+    uint64_t hash_ = 0;
+    bool interp_;
+    bool valid_;
+};
+
+#endif
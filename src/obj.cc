@@ -1,16 +1,21 @@
 #include "obj.hh"
+#include "mesh_cache.hh"
 #include <tiny_obj_loader.h>
 #include <cassert>
-#include <list>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <string>
+#include <unordered_map>
 
-Obj* Obj::parse(tinyxml2::XMLNode* node)
+Obj* Obj::parse(tinyxml2::XMLNode* node, Arena& arena)
 {
   const char* name = node->ToElement()->Attribute("path");
   double scale = 1;
   node->ToElement()->QueryDoubleAttribute("scale", &scale);
   Material* mat = nullptr;
   Vec3d trans (0,0,0);
-  double rot[3];
+  double rot[3] = {0, 0, 0};
 
   bool interp = node->ToElement()->Attribute("interp", "true");
 
@@ -22,7 +27,7 @@ Obj* Obj::parse(tinyxml2::XMLNode* node)
   {
     tinyxml2::XMLElement* elt_child = child->ToElement();
     if (is_named("material", elt_child))
-      mat = Material::parse(elt_child);
+      mat = Material::parse(elt_child, arena);
     else if (is_named("vec", elt_child) && elt_child->Attribute("name","translate"))
       trans = parseVec(elt_child);
     else if (is_named("rotate", elt_child))
@@ -42,7 +47,7 @@ Obj* Obj::parse(tinyxml2::XMLNode* node)
   // Deg to radians
   for (int i = 0; i < 3; i++)
     rot[i] = M_PI * rot[i]/180;
-  return new Obj(name, *mat, scale, trans, rot, interp);
+  return arena.make<Obj>(name, *mat, scale, trans, rot, interp);
 }
 
 Vec3d rotate(double rot[], double x, double y, double z)
@@ -60,111 +65,200 @@ Vec3d rotate(double rot[], double x, double y, double z)
   return Vec3d(xrot, yrot, zrot);
 }
 
-Vec3d project(double scale, Vec3d translate, double rot[], double x, double y, double z)
+// A position read from a file, used to weld the vertices of the triangles
+// which share it (the vertices of the file are duplicated by tinyobj when
+// their normals or their texture coordinates differ, and are not shared
+// between its shapes)
+struct Position
 {
-  x = x * scale + translate[0];
-  y = -y * scale + translate[1];
-  z = z * scale + translate[2];
+  float pt[3];
 
-  return rotate(rot, x, y, z);
-}
+  bool operator==(const Position& other) const
+  {
+    return pt[0] == other.pt[0] && pt[1] == other.pt[1] && pt[2] == other.pt[2];
+  }
+};
 
-Obj::Obj(const char* fname, Material& mat, double scale, Vec3d translate, double rot[], bool interp)
-  : Shape(mat), name_(fname)
+struct PositionHash
 {
+  size_t operator()(const Position& p) const
+  {
+    size_t hash = 0;
+    for (int i = 0; i < 3; i++)
+    {
+      // -0 and 0 are the same position
+      float val = (p.pt[i] == 0 ? 0 : p.pt[i]);
+      uint32_t bits;
+      std::memcpy(&bits, &val, sizeof (bits));
+      hash = hash * 1000003 ^ bits;
+    }
+    return hash;
+  }
+};
+
+// Loads the triangles of a file, in its own coordinates, into a Mesh. The
+// mesh is read from the cache of the file if there is one, and the cache is
+// written otherwise.
+static std::shared_ptr<const Mesh> loadMesh(const char* fname, bool interp)
+{
+  MeshCache cache (fname, interp);
+  std::shared_ptr<const Mesh> cached = cache.load();
+  if (cached)
+  {
+    std::cout << "Mesh cache: " << cache.path() << std::endl;
+    return cached;
+  }
+
   std::vector<tinyobj::shape_t> shapes;
-  std::vector<Shape*> contents;
-  std::string err = tinyobj::LoadObj(shapes, name_, "scenes/");
+  std::string err = tinyobj::LoadObj(shapes, fname, "scenes/");
   std::cout << "Error: " << err << std::endl;
-  std::map<Vec3d, std::list<Triangle*>> ptMap;
 
-  bool existNormals = false;
+  // The vertices of all the shapes one after the other, their normals if
+  // they are interpolated, and the vertices of the triangles
+  std::vector<float> positions;
+  std::vector<float> normals;
+  std::vector<uint32_t> indices;
+
+  // The normals of the vertices of the shapes which have none in the file
+  // are computed here, from the normals of the triangles (faces) around
+  // their welded vertex
+  const uint32_t none = std::numeric_limits<uint32_t>::max();
+  std::vector<uint32_t> welded_of;
+  std::vector<Vec3d> faces;
+  std::vector<uint32_t> welded_indices;
+  std::unordered_map<Position, uint32_t, PositionHash> welded;
 
   for (unsigned int s = 0; s < shapes.size(); s++)
   {
-    std::vector<float>& positions = shapes[s].mesh.positions;
-    std::vector<float>& normals = shapes[s].mesh.normals;
+    const std::vector<float>& shape_positions = shapes[s].mesh.positions;
+    const std::vector<float>& shape_normals = shapes[s].mesh.normals;
+    const std::vector<unsigned int>& shape_indices = shapes[s].mesh.indices;
+    uint32_t first = positions.size() / 3;
+    uint32_t count = shape_positions.size() / 3;
+    bool smooth = interp && shape_normals.size() == 0;
+
+    positions.insert(positions.end(), shape_positions.begin(), shape_positions.end());
 
-    for (unsigned int idx = 0; idx < shapes[s].mesh.indices.size() / 3; idx++)
+    if (interp && !smooth)
     {
-      unsigned int index1 =  shapes[s].mesh.indices[3 * idx];
-      unsigned int index2 =  shapes[s].mesh.indices[3 * idx + 1];
-      unsigned int index3 =  shapes[s].mesh.indices[3 * idx + 2];
-
-      Vec3d pt1 = project(scale, translate, rot,
-                          positions[index1 * 3],
-                          positions[index1 * 3 + 1],
-                          positions[index1 * 3 + 2]);
-      Vec3d pt2 = project(scale, translate, rot,
-                          positions[index2 * 3],
-                          positions[index2 * 3 + 1],
-                          positions[index2 * 3 + 2]);
-      Vec3d pt3 = project(scale, translate, rot,
-                          positions[index3 * 3],
-                          positions[index3 * 3 + 1],
-                          positions[index3 * 3 + 2]);
-
-      if (interp)
+      assert(shape_positions.size() == shape_normals.size());
+      normals.insert(normals.end(), shape_normals.begin(), shape_normals.end());
+    }
+    else if (smooth)
+      normals.resize(positions.size(), 0);
+
+    if (interp)
+      welded_of.resize(positions.size() / 3, none);
+
+    if (smooth)
+    {
+      for (uint32_t v = 0; v < count; v++)
       {
-        NormalTriangle* t = new NormalTriangle(pt1, pt2, pt3, material_);
+        const float* pt = &shape_positions[3 * v];
+        Position p = {{pt[0], pt[1], pt[2]}};
+        auto it = welded.insert(std::make_pair(p, welded.size())).first;
+        welded_of[first + v] = it->second;
+      }
+    }
 
-        contents.push_back(t);
-        if (normals.size() == 0)
-        {
-          ptMap[pt1].push_back(t);
-          ptMap[pt2].push_back(t);
-          ptMap[pt3].push_back(t);
-        }
-        else
+    for (unsigned int idx = 0; idx < shape_indices.size() / 3; idx++)
+    {
+      uint32_t tri[3];
+      for (int v = 0; v < 3; v++)
+      {
+        tri[v] = first + shape_indices[3 * idx + v];
+        indices.push_back(tri[v]);
+      }
+
+      if (smooth)
+      {
+        Vec3d pts[3];
+        for (int v = 0; v < 3; v++)
         {
-          existNormals = true;
-
-          //std::cout << "Normal size: " << std::endl;
-          assert(positions.size() == normals.size());
-          // FIXME: should be +0 +1 +2 instead of this
-          Vec3d n1  = rotate(rot, normals[index1 * 3 + 0], -normals[index1 * 3 + 1], normals[index1 * 3 + 2]);
-          Vec3d n2  = rotate(rot, normals[index2 * 3 + 0], -normals[index2 * 3 + 1], normals[index2 * 3 + 2]);
-          Vec3d n3  = rotate(rot, normals[index3 * 3 + 0], -normals[index3 * 3 + 1], normals[index3 * 3 + 2]);
-
-          t->setNormal(1, n1);
-          t->setNormal(2, n2);
-          t->setNormal(3, n3);
+          const float* pt = &positions[3 * tri[v]];
+          pts[v] = Vec3d(pt[0], pt[1], pt[2]);
+          welded_indices.push_back(welded_of[tri[v]]);
         }
+        faces.push_back(normalize((pts[2] - pts[1]).cross(pts[0] - pts[2])));
       }
-      else
-        contents.push_back(new Triangle(pt1, pt2, pt3, material_));
     }
   }
 
-  if (interp && !existNormals)
+  // The obj data is not needed anymore
+  std::vector<tinyobj::shape_t>().swap(shapes);
+
+  if (!faces.empty())
   {
-    for (unsigned int i = 0; i < contents.size(); i++)
-    {
-      ((NormalTriangle*) contents[i])->updateNormals(ptMap);
-    }
+    std::vector<Vec3d> smoothed =
+      Mesh::smoothNormals(faces, welded_indices, welded.size());
+    for (uint32_t v = 0; v < welded_of.size(); v++)
+      if (welded_of[v] != none)
+        for (int k = 0; k < 3; k++)
+          normals[3 * v + k] = smoothed[welded_of[v]][k];
   }
 
-  std::cout << "Size: " << contents.size() << std::endl;
+  std::cout << "Size: " << indices.size() / 3 << std::endl;
 
-  polygons_.buildTree(contents);
-  bbox_ = polygons_.getBBox();
+  std::shared_ptr<Mesh> mesh =
+    std::make_shared<Mesh>(std::move(positions), std::move(normals),
+                           std::move(indices));
+  std::cout << "Tree cost: " << mesh->tree().cost() << std::endl;
+  cache.save(*mesh);
+  return mesh;
 }
 
-bool Obj::containsPoint(const Vec3d& pt) const
+Obj::Obj(const char* fname, const Material& mat, double scale, Vec3d translate, double rot[], bool interp)
+  : Shape(mat), name_(fname), scale_(scale), inv_scale_(1. / scale)
 {
-    return polygons_.findSurroundingShape(pt) != nullptr;
+  // The files are loaded once, whatever the number of their instances; a
+  // mesh is released with its last instance
+  static std::map<std::pair<std::string, bool>, std::weak_ptr<const Mesh>> meshes;
+  std::weak_ptr<const Mesh>& mesh = meshes[std::make_pair(std::string(fname), interp)];
+  mesh_ = mesh.lock();
+  if (!mesh_)
+  {
+    mesh_ = loadMesh(fname, interp);
+    mesh = mesh_;
+  }
+
+  // The columns of the rotation are the images of the axes, the y axis of
+  // the file being reflected
+  Vec3d cols[3] = {rotate(rot, 1, 0, 0), rotate(rot, 0, -1, 0), rotate(rot, 0, 0, 1)};
+  for (int i = 0; i < 3; i++)
+    rows_[i] = Vec3d(cols[0][i], cols[1][i], cols[2][i]);
+  offset_ = rotate(rot, translate[0], translate[1], translate[2]);
+
+  // Bounding box of the transformed corners of the box of the mesh
+  BBox local = mesh_->tree().getBBox();
+  for (int c = 0; c < 8; c++)
+  {
+    Vec3d corner ((c & 1 ? local.maxpt : local.minpt)[0],
+                  (c & 2 ? local.maxpt : local.minpt)[1],
+                  (c & 4 ? local.maxpt : local.minpt)[2]);
+    Vec3d pt = scale_ * toWorld(corner) + offset_;
+    if (c == 0)
+      bbox_ = BBox(pt, pt);
+    else
+      bbox_.merge(BBox(pt, pt));
+  }
 }
 
-bool Obj::computeColorFromTexture(const Vec3d& where, Color& out) const
+void Obj::completeHit(const Ray& ray, Hit& hit) const
 {
-    Shape* s = polygons_.findSurroundingShape(where);
-
-    if (s == nullptr) // no Shape in polygons_ does contain where.
-    {
-        return false;
-    }
+    mesh_->barycentric(hit.primitive, toObject(ray), hit.u, hit.v);
+    hit.normal = normalize(toWorld(mesh_->faceNormal(hit.primitive)));
+    hit.shading_normal =
+      normalize(toWorld(mesh_->normal(hit.primitive, hit.u, hit.v)));
+    hit.two_sided = true;
+}
 
-    bool obvious_answer = s->computeColorFromTexture(where, out);
-    assert(obvious_answer == true);
-    return obvious_answer;
+bool Obj::computeColorFromTexture(const Hit& hit, double footprint,
+                                  Color& out) const
+{
+    // The texture coordinates of the triangle hit, in the units of the scene
+    double x;
+    double y;
+    mesh_->textureCoords(hit.primitive, pointToObject(hit.point), x, y);
+    out = material_.filtered_color_at(scale_ * x, scale_ * y, footprint);
+    return true;
 }
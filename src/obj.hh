@@ -2,17 +2,24 @@
 # define OBJ_HH_
 
 #include "shape.hh"
-#include "normaltriangle.hh"
+#include "mesh.hh"
 #include "vector.hh"
-#include "kdtree.hh"
+#include <memory>
 
+// An instance of a mesh loaded from an obj file. The Mesh is built once per
+// file, in the coordinates of the file, and shared by all the instances: each
+// instance maps the rays into the coordinates of the file instead of moving
+// the triangles. The transform is a uniform scale, a reflection of the y axis
+// (obj files are y-up), a translation and then a rotation; since the
+// directions are scaled but not normalized, distances along the rays are the
+// same in both spaces.
 class Obj: public Shape
 {
   public:
-    static Obj* parse(tinyxml2::XMLNode* node);
+    static Obj* parse(tinyxml2::XMLNode* node, Arena& arena);
 
     Obj(const char* fname,
-        Material& mat,
+        const Material& mat,
         double scale,
         Vec3d translate,
         double rot[],
@@ -20,32 +27,118 @@ class Obj: public Shape
 
     bool intersect(Ray ray, Vec3d& intersect, double& dist) const
     {
-      return (polygons_.intersect(ray, intersect, dist) != 0);
+      Hit hit;
+      if (!this->intersect(ray, hit))
+        return false;
+      intersect = hit.point;
+      dist = hit.dist;
+      return true;
     }
 
-    bool containsPoint(const Vec3d& pt) const;
+    // The primitive of hit is the triangle of the mesh
+    bool intersect(const Ray& ray, Hit& hit) const override
+    {
+      Hit local;
+      local.dist = hit.dist;
+      int t = mesh_->tree().traverse(0, toObject(ray), local);
+      if (t < 0)
+        return false;
 
-    bool computeColorFromTexture(const Vec3d& where, Color& out) const override;
+      hit.dist = local.dist;
+      hit.point = ray.orig() + hit.dist * ray.dir();
+      hit.primitive = t;
+      return true;
+    }
 
-    BBox getBBox() { return bbox_; }
+    bool occludes(const Ray& ray, double max_dist) const override
+    {
+      return mesh_->tree().occluded(toObject(ray), max_dist);
+    }
 
-    Vec3d normal(Ray& ray)
+    vmask intersectPacket(const RayPacket& packet, vmask active,
+                          PacketHit& hit) const override
     {
-      Vec3d intersect;
-      double dist;
-      Shape* shape = polygons_.intersect(ray, intersect, dist);
+      PacketHit local;
+      local.dist = hit.dist;
+      for (int i = 0; i < PACKET_SIZE; i++)
+        local.index[i] = -1;
 
-      if (shape)
-        return shape->normal(ray);
-      else
-      { // FIXME: real handling
-        return Vec3d(0,0,0);
+      mesh_->tree().recIntersect(0, toObject(packet), active, local);
+
+      vmask hits;
+      for (int i = 0; i < PACKET_SIZE; i++)
+      {
+        hits[i] = (local.index[i] >= 0 ? -1 : 0);
+        if (hits[i])
+          hit.primitive[i] = local.index[i];
       }
+      hit.dist = local.dist;
+      return hits;
+    }
+
+    vmask occludesPacket(const RayPacket& packet, vmask active,
+                         vdouble max_dist) const override
+    {
+      return mesh_->tree().recOccluded(0, toObject(packet), active, max_dist);
     }
 
+    const KDTree* instanceTree() const override {return &mesh_->tree();}
+
+    Ray toInstance(const Ray& ray) const override {return toObject(ray);}
+
+    // Only tests the bounding box of the instance: the triangle of a hit is
+    // known from the hit itself
+    bool containsPoint(const Vec3d& pt) const override
+    {
+      return bbox_.containsPoint(pt);
+    }
+
+    bool computeColorFromTexture(const Hit& hit, double footprint,
+                                 Color& out) const override;
+
+    BBox getBBox() { return bbox_; }
+
+    void completeHit(const Ray& ray, Hit& hit) const override;
+
   private:
+    // Rotation (and reflection) part of the transform, applied to a vector
+    // given in the coordinates of the file, and its inverse
+    Vec3d toWorld(Vec3d v) const
+    {
+      return Vec3d(rows_[0].dot(v), rows_[1].dot(v), rows_[2].dot(v));
+    }
+
+    Vec3d fromWorld(Vec3d v) const
+    {
+      return v[0] * rows_[0] + v[1] * rows_[1] + v[2] * rows_[2];
+    }
+
+    Vec3d pointToObject(const Vec3d& pt) const
+    {
+      return inv_scale_ * fromWorld(pt - offset_);
+    }
+
+    Ray toObject(const Ray& ray) const
+    {
+      return Ray(pointToObject(ray.orig()), inv_scale_ * fromWorld(ray.dir()));
+    }
+
+    RayPacket toObject(const RayPacket& packet) const
+    {
+      Ray rays[PACKET_SIZE];
+      for (int i = 0; i < PACKET_SIZE; i++)
+        rays[i] = toObject(packet.ray(i));
+      return RayPacket(rays, PACKET_SIZE);
+    }
+
     const char* name_;
-    KDTree polygons_;
+    std::shared_ptr<const Mesh> mesh_;
+
+    // A point p of the file is at scale_ * toWorld(p) + offset_
+    Vec3d rows_[3];
+    double scale_;
+    double inv_scale_;
+    Vec3d offset_;
 };
 
 #endif
@@ -0,0 +1,97 @@
+#ifndef PACKET_HH_
+# define PACKET_HH_
+
+#include "ray.hh"
+
+// Packets of rays traced together through the KDTree. Each lane of the vector
+// types below holds the value for one ray of the packet; they are compiled to
+// SSE or AVX instructions depending on the target.
+#define PACKET_SIZE 4
+
+typedef double vdouble __attribute__ ((vector_size (PACKET_SIZE * sizeof (double))));
+typedef long long vmask __attribute__ ((vector_size (PACKET_SIZE * sizeof (long long))));
+
+class Shape;
+
+inline vdouble splat(double val)
+{
+  vdouble ret;
+  for (int i = 0; i < PACKET_SIZE; i++)
+    ret[i] = val;
+  return ret;
+}
+
+inline vmask splatMask(bool val)
+{
+  vmask ret;
+  for (int i = 0; i < PACKET_SIZE; i++)
+    ret[i] = (val ? -1 : 0);
+  return ret;
+}
+
+inline int countLanes(vmask mask)
+{
+  int count = 0;
+  for (int i = 0; i < PACKET_SIZE; i++)
+    count += (mask[i] != 0);
+  return count;
+}
+
+// Lane-wise minimum and maximum. Like std::min and std::max, they return a
+// when one of the values is NaN.
+inline vdouble vmin(vdouble a, vdouble b)
+{
+  return (b < a ? b : a);
+}
+
+inline vdouble vmax(vdouble a, vdouble b)
+{
+  return (a < b ? b : a);
+}
+
+class RayPacket
+{
+  public:
+    // Packs count (at most PACKET_SIZE) rays; the remaining lanes are
+    // inactive
+    RayPacket(const Ray* rays, int count)
+    {
+      for (int i = 0; i < PACKET_SIZE; i++)
+      {
+        rays_[i] = rays[i < count ? i : 0];
+        Vec3d o = rays_[i].orig();
+        Vec3d d = rays_[i].dir();
+        for (int k = 0; k < 3; k++)
+        {
+          orig[k][i] = o[k];
+          dir[k][i] = d[k];
+          inv_dir[k][i] = 1. / d[k];
+        }
+        active[i] = (i < count ? -1 : 0);
+      }
+    }
+
+    const Ray& ray(int lane) const {return rays_[lane];}
+
+    vdouble orig[3];
+    vdouble dir[3];
+    vdouble inv_dir[3];
+    vmask active;
+
+  private:
+    // The rays themselves, for the lanes that fall back to single ray tracing
+    Ray rays_[PACKET_SIZE];
+};
+
+// Closest hit of every lane of a packet: its distance, its index in the
+// order of the leaves of the KDTree (-1 if there is no hit), its shape and
+// its primitive (see Hit)
+struct PacketHit
+{
+  vdouble dist;
+  int index[PACKET_SIZE];
+  Shape* shape[PACKET_SIZE];
+  int primitive[PACKET_SIZE];
+};
+
+#endif
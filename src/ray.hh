@@ -17,4 +17,33 @@ class Ray
     Vec3d dir_;
 };
 
+// A ray prepared for the traversal of a KDTree: the reciprocal of its
+// direction and the signs of its components are computed once, in the
+// precision of the boxes of the nodes, instead of at every node.
+// The components which are zero (of either sign) are flagged as parallel and
+// get no reciprocal: the build uses -Ofast, under which neither the infinity
+// of 1 / 0 nor the sign of -0 can be relied on.
+struct TraversalRay
+{
+  explicit TraversalRay(const Ray& r) : ray(r)
+  {
+    Vec3d o = r.orig();
+    Vec3d d = r.dir();
+    for (int i = 0; i < 3; i++)
+    {
+      accel_t di = d[i];
+      orig[i] = o[i];
+      parallel[i] = (di == 0);
+      inv_dir[i] = (parallel[i] ? 0 : accel_t(1) / di);
+      sign[i] = (di < 0);
+    }
+  }
+
+  Ray ray;
+  Vector<accel_t,3> orig;
+  Vector<accel_t,3> inv_dir;
+  int sign[3];
+  bool parallel[3];
+};
+
 #endif
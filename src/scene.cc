@@ -1,12 +1,17 @@
 #include "scene.hh"
 #include "vector.hh"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <limits>
+#include <mutex>
 
 Scene* Scene::parse(char* path, int x, int y)
 {
+  std::unique_ptr<Arena> arena (new Arena());
   Camera* camera = NULL;
-  std::vector<Shape*>* shapes = new std::vector<Shape*>();
-  std::vector<Light>* lights = new std::vector<Light>();
+  std::vector<Shape*> shapes;
+  std::vector<Light> lights;
 
   tinyxml2::XMLDocument doc;
   doc.LoadFile(path);
@@ -18,13 +23,13 @@ Scene* Scene::parse(char* path, int x, int y)
   do
   {
     if (is_named("camera", child))
-      camera = Camera::parse(child->FirstChild(), x, y);
+      camera = Camera::parse(child->FirstChild(), x, y, *arena);
     else if (is_named("shapes", child))
     {
       tinyxml2::XMLNode* xmlshapes = child->FirstChild();
       do
       {
-        shapes->push_back(Shape::parse(xmlshapes));
+        shapes.push_back(Shape::parse(xmlshapes, *arena));
       }
       while ((xmlshapes = xmlshapes->NextSibling()));
     }
@@ -33,7 +38,7 @@ Scene* Scene::parse(char* path, int x, int y)
       tinyxml2::XMLNode* xmllights = child->FirstChild();
       do
       {
-        lights->push_back(Light::parse(xmllights));
+        lights.push_back(Light::parse(xmllights));
       }
       while ((xmllights = xmllights->NextSibling()));
     }
@@ -44,36 +49,54 @@ Scene* Scene::parse(char* path, int x, int y)
   while ((child = child->NextSibling()));
 
   // FIXME: type
-  Scene* res = new Scene(*camera, *shapes, *lights);
+  Scene* res = new Scene(std::move(arena), *camera, shapes, lights);
   res->setDims(x,y);
   return res;
 }
 
 void Scene::setDims(int x, int y)
 {
-  canvas_ = std::vector<Color>(x * y);
+  canvas_ = Framebuffer(x, y);
+  hit_shapes_ = std::vector<Shape*>(x * y);
   x_ = x;
   y_ = y;
 }
 
-Shape* Scene::hit(Ray& ray, Vec3d& best_hit, double& best_dist)
+bool Scene::hit(Ray& ray, Hit& hit)
 {
+  if (!shapes_.intersect(ray, hit))
+    return false;
 
-  return shapes_.intersect(ray, best_hit, best_dist);
+  hit.shape->completeHit(ray, hit);
+  return true;
 }
 
-Color Scene::render_light(Ray &ray, Vec3d intersection, Light& l, Shape& shape, int depth)
+double Scene::footprint(Ray& ray, const Hit& hit)
 {
-  Color color = l.illumination(shape, ray, intersection, shapes_);
+  if (!hit.shape->getMaterial().is_filtered())
+    return 0;
+
+  // The footprint of a pixel grows with the distance travelled by the last
+  // ray (reflections being seen through the same pixel), and is stretched on
+  // surfaces seen at a grazing angle
+  double incidence = fabs(hit.shading_normal.dot(ray.dir()));
+  return cam_.pixelSpread() * hit.dist / std::max(incidence, 1e-3);
+}
+
+Color Scene::render_light(Ray &ray, const Hit& hit, Light& l, int depth,
+                          double footprint, int first_shadow)
+{
+  Color color = l.illumination(hit, ray, shapes_, first_shadow,
+                               soft_shadows_, footprint);
 
   // Reflection rendering
   // We launch the reflected ray
   // FIXME: reflection (shift)
-  Ray refl_ray = shape.reflect(Ray(intersection, ray.dir()));
+  Ray refl_ray = hit.reflect(ray.dir());
   Color refl_color = color;
-  float refl_coef = shape.getMaterial().get_refl();
+  float refl_coef = hit.shape->getMaterial().get_refl();
   //std::cout << "Refl: " << refl_coef << std::endl;
-  if (depth < 5 && refl_coef > 0)
+  if (depth < max_depth_ && refl_coef > 0)
   {
     // FIXME: make diffuse reflection
     refl_color = ray_launch(refl_ray, depth + 1);
@@ -86,73 +109,344 @@ Color Scene::render_light(Ray &ray, Vec3d intersection, Light& l, Shape& shape,
 
 
 
-Color Scene::ray_launch(Ray& ray, int depth)
+Color Scene::ray_launch(Ray& ray, int depth, Shape** hit_shape)
 {
 
-  Shape* shape;
   // We first check for a hit with a shape
-  Vec3d intersection;
-  double inter_dist;
+  Hit closest;
 
   Color result;
 
   // if there is a hit, we take into account the lights of the scene
-  if ((shape = hit(ray, intersection, inter_dist)))
+  if (hit(ray, closest))
+  {
+    double width = footprint(ray, closest);
     for (auto l : lights_)
-      result = result + render_light(ray, intersection, l, *shape, depth); // FIXME
+      result = result + render_light(ray, closest, l, depth, width); // FIXME
+  }
 
+  if (hit_shape)
+    *hit_shape = closest.shape;
   return result;
 }
 
-// For each ray, compute the color
-void Scene::render(void)
+void Scene::ray_launch_packet(const Ray* rays, int count, Color* colors,
+                              Shape** hit_shapes)
 {
-  std::cout << "RENDER" << std::endl;
-  std::vector<Ray>& mat = cam_.getRays();
+  RayPacket packet(rays, count);
+  PacketHit hit;
+  shapes_.intersect(packet, hit);
 
-  int max = x_ * y_;
-  int prev = -1;
-  int cur = 0;
+  vmask hits;
+  Hit lanes[PACKET_SIZE];
+  for (int i = 0; i < PACKET_SIZE; i++)
+  {
+    hits[i] = (packet.active[i] && hit.shape[i] ? -1 : 0);
+    if (!hits[i])
+      continue;
+
+    lanes[i].shape = hit.shape[i];
+    lanes[i].dist = hit.dist[i];
+    lanes[i].point = rays[i].orig() + hit.dist[i] * rays[i].dir();
+    lanes[i].primitive = hit.primitive[i];
+    lanes[i].shape->completeHit(rays[i], lanes[i]);
+  }
+
+  // The rays from the center of each light to the intersections are traced
+  // as packets too
+  std::vector<int> shadows(lights_.size() * PACKET_SIZE);
+  for (unsigned int l = 0; l < lights_.size(); l++)
+  {
+    Ray light_rays[PACKET_SIZE];
+    vdouble max_dist = splat(0);
+    for (int i = 0; i < PACKET_SIZE; i++)
+    {
+      if (hits[i])
+        light_rays[i] = lights_[l].lightRay(lanes[i].point, max_dist[i]);
+      else
+        light_rays[i] = Ray(lights_[l].orig(), Vec3d(0, 0, 1));
+    }
+
+    RayPacket light_packet(light_rays, PACKET_SIZE);
+    light_packet.active = hits;
+    vmask occluded = shapes_.occluded(light_packet, max_dist);
+    for (int i = 0; i < PACKET_SIZE; i++)
+      shadows[l * PACKET_SIZE + i] = (occluded[i] ? 1 : 0);
+  }
+
+  for (int i = 0; i < count; i++)
+  {
+    colors[i] = Color();
+    hit_shapes[i] = hit.shape[i];
+    if (!hits[i])
+      continue;
+
+    Ray ray = rays[i];
+    double width = footprint(ray, lanes[i]);
+    for (unsigned int l = 0; l < lights_.size(); l++)
+      colors[i] = colors[i] + render_light(ray, lanes[i], lights_[l], 0, width,
+                                           shadows[l * PACKET_SIZE + i]);
+  }
+}
+
+int Scene::render_tile(int x0, int y0, int x1, int y1, bool packets,
+                       int step, bool refine)
+{
+  // The pixels of the pass, by blocks of 2x2 of them for the packets. Tiles
+  // start on multiples of 2 * step, so the pixels rendered by the previous
+  // pass are the first ones of the blocks.
+  static_assert(PACKET_SIZE == 4, "packets are made of 2x2 pixels");
+  std::vector<int> pixels;
+  for (int j = y0; j < y1; j += 2 * step)
+    for (int i = x0; i < x1; i += 2 * step)
+      for (int b = (refine ? 1 : 0); b < PACKET_SIZE; b++)
+      {
+        int pi = i + (b % 2) * step;
+        int pj = j + (b / 2) * step;
+        if (pi < x1 && pj < y1)
+          pixels.push_back(pj * x_ + pi);
+      }
+
+  std::vector<Color> colors(pixels.size());
+  std::vector<Shape*> shapes(pixels.size());
+  int count = pixels.size();
+  for (int p = 0; p < count; p += (packets ? PACKET_SIZE : 1))
+  {
+    if (!packets)
+    {
+      Ray ray = cam_.getRay(pixels[p] % x_, pixels[p] / x_);
+      colors[p] = ray_launch(ray, 0, &shapes[p]);
+      continue;
+    }
+
+    Ray block[PACKET_SIZE];
+    int lanes = std::min(PACKET_SIZE, count - p);
+    for (int b = 0; b < lanes; b++)
+      block[b] = cam_.getRay(pixels[p + b] % x_, pixels[p + b] / x_);
+    ray_launch_packet(block, lanes, &colors[p], &shapes[p]);
+  }
+
+  std::lock_guard<std::mutex> lock(canvas_lock_);
+  for (int p = 0; p < count; p++)
+  {
+    int pi = pixels[p] % x_;
+    int pj = pixels[p] / x_;
+    for (int b = pj; b < std::min(pj + step, y1); b++)
+      for (int a = pi; a < std::min(pi + step, x1); a++)
+      {
+        canvas_.set(b * x_ + a, colors[p]);
+        hit_shapes_[b * x_ + a] = shapes[p];
+      }
+  }
+  return count;
+}
+
+static bool differ(const Framebuffer& canvas, int a, int b, double threshold)
+{
+  for (int c = 0; c < 3; c++)
+    if (fabs(canvas.at(a, c) - canvas.at(b, c)) > threshold)
+      return true;
+  return false;
+}
+
+std::vector<char> Scene::find_aliased(double threshold) const
+{
+  std::vector<char> aliased(x_ * y_, 0);
+
+  // Both pixels of a pair of horizontal or vertical neighbours that differ
+  // are marked
   for (int j = 0; j < y_; j++)
     for (int i = 0; i < x_; i++)
     {
-      cur = j * x_ + i;
-      int percent = (int) (100 * ((float) cur)/((float) max));
-      if (percent != prev)
-        std::cout << percent << "% (" << cur << "/" << max << ")\r" << std::flush;
-      prev = percent;
-      canvas_[j*x_ + i] = ray_launch(mat[j * x_ + i], 0);
+      int cur = j * x_ + i;
+      int right = cur + 1;
+      int down = cur + x_;
+
+      if (i + 1 < x_ && (hit_shapes_[cur] != hit_shapes_[right]
+                         || differ(canvas_, cur, right, threshold)))
+        aliased[cur] = aliased[right] = 1;
+
+      if (j + 1 < y_ && (hit_shapes_[cur] != hit_shapes_[down]
+                         || differ(canvas_, cur, down, threshold)))
+        aliased[cur] = aliased[down] = 1;
     }
-  std::cout << std::endl;
-}
 
+  return aliased;
+}
 
-void Scene::save(std::string fname)
+int Scene::antialias_tile(int x0, int y0, int x1, int y1, bool packets,
+                          int grid, const std::vector<char>& aliased)
 {
-  int out_y = y_ / SIZE_FACTOR;
-  int out_x = x_ / SIZE_FACTOR;
-  cv::Mat img (out_y, out_x, CV_8UC3);
+  int traced = 0;
+  double inv_grid = 1. / grid;
 
-  std::cout << "SAVE" << std::endl;
-  std::cout << y_ << " " << x_ << std::endl;
+  for (int j = y0; j < y1; j++)
+    for (int i = x0; i < x1; i++)
+    {
+      if (!aliased[j * x_ + i])
+        continue;
+
+      // The samples of the pixel, row by row, the first one being the ray
+      // already traced through the corner of the pixel
+      std::vector<Ray> rays;
+      for (int b = 0; b < grid; b++)
+        for (int a = 0; a < grid; a++)
+          if (a != 0 || b != 0)
+            rays.push_back(cam_.getRay(i + a * inv_grid, j + b * inv_grid));
+
+      int count = rays.size();
+      std::vector<Color> colors(count);
+      for (int p = 0; p < count; p += (packets ? PACKET_SIZE : 1))
+      {
+        if (!packets)
+          colors[p] = ray_launch(rays[p], 0);
+        else
+        {
+          Shape* shapes[PACKET_SIZE];
+          ray_launch_packet(&rays[p], std::min(PACKET_SIZE, count - p),
+                            &colors[p], shapes);
+        }
+      }
+      traced += count;
 
-  for (int j = 0; j < out_y; j++)
-    for (int i = 0; i < out_x; i++)
+      // An empty sample counts as a black one
+      std::lock_guard<std::mutex> lock(canvas_lock_);
+      canvas_.average(j * x_ + i, colors.data(), count);
+    }
+
+  return traced;
+}
+
+int Scene::render_pass(ThreadPool& pool, const RenderOptions& options,
+                       const std::function<int (int, int, int, int)>& tile)
+{
+  int max = x_ * y_;
+  int prev = -1;
+  int cur = 0;
+  int rendered = 0;
+  std::mutex progress_lock;
+
+  // Every tile writes to its own region of canvas_, so the workers only
+  // synchronise to report the progress and to save partial images.
+  for (int y0 = 0; y0 < y_; y0 += TILE_SIZE)
+    for (int x0 = 0; x0 < x_; x0 += TILE_SIZE)
     {
-      Color total (0,0,0,0);
-      for (int b = j * SIZE_FACTOR; b < (j+1) * SIZE_FACTOR; b++)
-        for (int a = i * SIZE_FACTOR; a < (i+1) * SIZE_FACTOR; a++)
+      int x1 = std::min(x0 + TILE_SIZE, x_);
+      int y1 = std::min(y0 + TILE_SIZE, y_);
+      pool.push([this, &options, &tile, &progress_lock, &cur, &prev, &rendered,
+                 max, x0, y0, x1, y1]
+      {
+        int count = tile(x0, y0, x1, y1);
+
+        std::lock_guard<std::mutex> lock(progress_lock);
+        rendered += count;
+        cur += (x1 - x0) * (y1 - y0);
+        int percent = (int) (100 * ((float) cur)/((float) max));
+        if (percent != prev)
+          std::cout << percent << "% (" << cur << "/" << max << ")\r" << std::flush;
+        prev = percent;
+
+        auto now = std::chrono::steady_clock::now();
+        std::chrono::duration<double> since_save = now - last_save_;
+        if (options.progressive && since_save.count() >= options.save_interval)
         {
-          Color cur = canvas_[b * x_ + a];
-          if (cur.max() == 0)
-            total = total + Color(0,0,0);
-          else
-            total = total + canvas_[b * x_ + a];
+          std::lock_guard<std::mutex> canvas(canvas_lock_);
+          save(options.output);
+          last_save_ = now;
         }
-      img.at<cv::Vec3b>(j,i) = total.toBgr();
+      });
+    }
+
+  pool.wait();
+  return rendered;
+}
+
+// For each ray, compute the color
+void Scene::render(const RenderOptions& options)
+{
+  std::cout << "RENDER" << std::endl;
+
+  int max = x_ * y_;
+  int rendered = max;
+  auto start = std::chrono::steady_clock::now();
+  last_save_ = start;
+
+  int grid = static_cast<int>(sqrt(static_cast<double>(options.samples)));
+
+  if (options.threads == 1 && !options.packets && !options.progressive)
+  {
+    int prev = -1;
+    int cur = 0;
+    for (int j = 0; j < y_; j++)
+      for (int i = 0; i < x_; i++)
+      {
+        cur = j * x_ + i;
+        int percent = (int) (100 * ((float) cur)/((float) max));
+        if (percent != prev)
+          std::cout << percent << "% (" << cur << "/" << max << ")\r" << std::flush;
+        prev = percent;
+        Ray ray = cam_.getRay(i, j);
+        canvas_.set(j*x_ + i, ray_launch(ray, 0, &hit_shapes_[j*x_ + i]));
+      }
+
+    if (grid > 1)
+      rendered += antialias_tile(0, 0, x_, y_, false, grid,
+                                 find_aliased(options.aa_threshold));
+  }
+  else
+  {
+    ThreadPool pool(options.threads);
+    std::cout << "Threads: " << pool.size() << std::endl;
 
+    auto pass = [this, &options](int step, bool refine)
+    {
+      return [this, &options, step, refine](int x0, int y0, int x1, int y1)
+      {
+        return render_tile(x0, y0, x1, y1, options.packets, step, refine);
+      };
+    };
+
+    if (!options.progressive)
+      rendered = render_pass(pool, options, pass(1, false));
+    else
+    {
+      // Coarse preview, saved as soon as it is done
+      max_depth_ = PREVIEW_DEPTH;
+      soft_shadows_ = false;
+      rendered = render_pass(pool, options, pass(PROGRESSIVE_STEP, false));
+      save(options.output);
+      last_save_ = std::chrono::steady_clock::now();
+
+      // Every pixel is then rendered once at full quality, the first pass
+      // replacing the pixels of the preview
+      max_depth_ = MAX_DEPTH;
+      soft_shadows_ = true;
+      for (int step = PROGRESSIVE_STEP; step >= 1; step /= 2)
+        rendered += render_pass(pool, options, pass(step, step != PROGRESSIVE_STEP));
     }
 
+    if (grid > 1)
+    {
+      std::vector<char> aliased = find_aliased(options.aa_threshold);
+      rendered += render_pass(pool, options,
+          [this, &options, &aliased, grid](int x0, int y0, int x1, int y1)
+          {
+            return antialias_tile(x0, y0, x1, y1, options.packets, grid, aliased);
+          });
+    }
+  }
+  std::cout << std::endl;
+
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  std::cout << "Rendered " << rendered << " primary rays in " << elapsed.count()
+            << "s (" << rendered / elapsed.count() << " rays/s)" << std::endl;
+}
+
+
+void Scene::save(std::string fname)
+{
+  std::cout << "SAVE" << std::endl;
+  std::cout << y_ << " " << x_ << std::endl;
 
-  cv::imwrite(fname, img);
+  cv::imwrite(fname, canvas_.toImage());
 }
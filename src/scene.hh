@@ -1,33 +1,96 @@
 #ifndef SCENE_HH_
 # define SCENE_HH_
 
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <cv.h>
 #include <highgui.h>
 #include <tinyxml2.h>
 #include "utils.hh"
+#include "arena.hh"
 #include "camera.hh"
 #include "shape.hh"
 #include "obj.hh"
 #include "light.hh"
 #include "kdtree.hh"
+#include "packet.hh"
+#include "thread_pool.hh"
+#include "framebuffer.hh"
 #include "vector.hh"
 
-// The size factor is used for supersampling. Supersampling is a technique used
-// in order to have simple anti-aliasing on a scene. It creates a bigger image
-// (and therefore, more precise), and then reduces it with interpolation before
-// saving it;
-#define SIZE_FACTOR 2
+// Adaptive supersampling (anti-aliasing): every pixel is first rendered with a
+// single ray. A pixel which does not show the same shape as one of its
+// neighbours, or whose color differs from it by more than a threshold on a
+// channel (colors being between 0 and 1), is then rendered again with a grid
+// of samples. Default maximum number of samples per pixel, and threshold.
+#define AA_SAMPLES 4
+#define AA_THRESHOLD 0.1
+
+// The parallel renderer splits the canvas into square tiles of TILE_SIZE
+// pixels, which are the unit of work given to the render threads.
+#define TILE_SIZE 32
+
+// Maximum number of reflections of a ray, and the lower one used for the
+// coarse pass of progressive rendering
+#define MAX_DEPTH 5
+#define PREVIEW_DEPTH 1
+
+// Progressive rendering starts with one pixel every PROGRESSIVE_STEP pixels on
+// each axis (a power of two dividing TILE_SIZE), and halves this step at each
+// pass. The partial image is saved every PROGRESSIVE_INTERVAL seconds by
+// default.
+#define PROGRESSIVE_STEP 8
+#define PROGRESSIVE_INTERVAL 10.
+
+/// Options of Scene::render
+struct RenderOptions
+{
+  RenderOptions()
+    : threads(1), packets(false), progressive(false),
+      save_interval(PROGRESSIVE_INTERVAL), samples(AA_SAMPLES),
+      aa_threshold(AA_THRESHOLD)
+  {}
+
+  // Number of render threads, 0 for one per hardware thread. With one thread
+  // (and no packets) the canvas is rendered row by row on the calling thread.
+  unsigned int threads;
+
+  // Trace the primary rays, and the shadow rays toward the center of each
+  // light, by packets of PACKET_SIZE rays
+  bool packets;
+
+  // Render a coarse preview (one pixel out of PROGRESSIVE_STEP on each axis,
+  // PREVIEW_DEPTH reflections, a single shadow ray per light), then refine it
+  // at full quality in passes, saving the partial image to output every
+  // save_interval seconds and after the preview.
+  bool progressive;
+  std::string output;
+  double save_interval;
+
+  // Maximum number of samples of a pixel, rounded down to a square; 1
+  // disables anti-aliasing
+  unsigned int samples;
+  double aa_threshold;
+};
 
 /// The scene contains all the necessary element to render an image
 class Scene
 {
   public:
-    Scene(Camera& cam, std::vector<Shape*>& shapes, std::vector<Light>& lights)
-      : cam_(cam), shapes_(), lights_(lights)
+    // The camera and the shapes belong to arena, which is released with the
+    // scene
+    Scene(std::unique_ptr<Arena> arena, Camera& cam,
+          const std::vector<Shape*>& shapes, std::vector<Light> lights)
+      : arena_(std::move(arena)), cam_(cam), shapes_(), lights_(lights),
+        max_depth_(MAX_DEPTH),
+        soft_shadows_(true)
     {
       std::cout << "Scene: " << std::endl;
       shapes_.buildTree(shapes);
+      std::cout << "Tree cost: " << shapes_.cost() << std::endl;
     }
 
     // Returns a fresh scene parsed from a file
@@ -37,7 +100,7 @@ class Scene
     void setDims(int x, int y);
 
     // Renders and scene and fill canvas_
-    void render(void);
+    void render(const RenderOptions& options = RenderOptions());
 
     // Saves canvas_ into fname
     void save(std::string fname);
@@ -45,30 +108,66 @@ class Scene
     KDTree& shapes() {return shapes_;}
 
   private:
-    // Launches a ray into a scene, and tries to hit a shape. Returns the
-    // closest shape hit, with the location of the intersection point and its
-    // distance to the origin of the ray. s_id represents the shape that is
-    // hit. If no hit, returns NULL and s_id is set to -1
-    // FIXME: better return type ?
-    //bool hit(Ray& ray, int& s_id, Vec3d& intersect, double& dist);
-    Shape* hit(Ray& ray, Vec3d& best_hit, double& best_dist);
-
-    Color render_light(Ray &ray, Vec3d intersection, Light& l, Shape& shape, int depth);
+    // Launches a ray into a scene, and tries to hit a shape. Returns true if
+    // it does, with hit set to the closest hit, completed for shading.
+    bool hit(Ray& ray, Hit& hit);
+
+    // Width of the surface seen through a pixel at hit, the closest hit of
+    // ray, or 0 if its material does not use it
+    double footprint(Ray& ray, const Hit& hit);
+
+    // Color of hit, the closest hit of ray, lit by l. footprint is the value
+    // computed above for this hit. first_shadow is the occlusion of the first
+    // light ray if already known, see Light::illumination
+    Color render_light(Ray &ray, const Hit& hit, Light& l, int depth,
+                       double footprint, int first_shadow = -1);
     /// Does the complete rendering of the scene for a given ray.
     // The depth parameter is used to determine the maximum reflection depth
     // (reflection computation is just a recursion with a new ray).
-    // Returns the color associated to the pixel that we try to render
-    Color ray_launch(Ray& ray, int depth);
+    // Returns the color associated to the pixel that we try to render, and
+    // sets hit_shape to the shape hit if given
+    Color ray_launch(Ray& ray, int depth, Shape** hit_shape = nullptr);
 
     // Soft shadows rendering method. For now, sucks a lot, since it takes time
     // for a bad result.
     double soft_shadows_comp(Ray& lray, Shape& shape);
 
+    // Renders the pixels of canvas_ in [x0,x1[ x [y0,y1[ whose coordinates are
+    // multiples of step, by packets of 2x2 of those pixels if packets is set.
+    // If refine is set, the pixels already rendered by the previous pass (of
+    // step 2 * step) are skipped. Each pixel is copied to the step x step
+    // block it starts. Returns the number of pixels rendered.
+    int render_tile(int x0, int y0, int x1, int y1, bool packets,
+                    int step = 1, bool refine = false);
+
+    // Renders again the pixels of [x0,x1[ x [y0,y1[ set in aliased, with
+    // grid x grid samples each, the first one being the current pixel.
+    // Returns the number of rays traced.
+    int antialias_tile(int x0, int y0, int x1, int y1, bool packets, int grid,
+                       const std::vector<char>& aliased);
+
+    // Marks the pixels which must be anti-aliased, see AA_SAMPLES
+    std::vector<char> find_aliased(double threshold) const;
+
+    // Runs tile on every tile of the canvas on pool, reporting the progress,
+    // and saving the partial image at the interval given by options if it is
+    // progressive. Returns the sum of the values returned by tile.
+    int render_pass(ThreadPool& pool, const RenderOptions& options,
+                    const std::function<int (int, int, int, int)>& tile);
+
+    // Same as ray_launch for count (at most PACKET_SIZE) primary rays traced
+    // as a packet
+    void ray_launch_packet(const Ray* rays, int count, Color* colors,
+                           Shape** hit_shapes);
+
     // The dimension of the canvas to render.
     // FIXME: redundant with camera x_ and y_. Better design possible ?
     int x_;
     int y_;
 
+    // Owns the camera, the shapes and their materials
+    std::unique_ptr<Arena> arena_;
+
     // The view point of view
     Camera& cam_;
 
@@ -78,10 +177,21 @@ class Scene
     KDTree shapes_; // FIXME: have real structure after
 
     // The lights illuminating the scene
-    std::vector<Light>& lights_;
+    std::vector<Light> lights_;
+
+    // The pixel of the image we render, and the shape seen by each of them
+    Framebuffer canvas_;
+    std::vector<Shape*> hit_shapes_;
+
+    // Quality of the current pass: maximum reflection depth, and whether
+    // every sample of the lights is traced
+    int max_depth_;
+    bool soft_shadows_;
 
-    // The pixel of the image we render
-    std::vector<Color> canvas_;
+    // Held when writing tiles into canvas_, so that the partial images of a
+    // progressive render are saved consistently
+    std::mutex canvas_lock_;
+    std::chrono::steady_clock::time_point last_save_;
 };
 
 #endif
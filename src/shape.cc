@@ -1,19 +1,21 @@
 #include <tiny_obj_loader.h>
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 
 #include "shape.hh"
 #include "obj.hh"
 
-Shape* Shape::parse(tinyxml2::XMLNode* node)
+Shape* Shape::parse(tinyxml2::XMLNode* node, Arena& arena)
 {
   if (is_named("sphere", node))
-    return Sphere::parse(node);
+    return Sphere::parse(node, arena);
   else if (is_named("plane", node))
-    return Plane::parse(node);
+    return Plane::parse(node, arena);
   else if (is_named("triangle", node))
-    return Triangle::parse(node);
+    return Triangle::parse(node, arena);
   else if (is_named("obj", node))
-    return Obj::parse(node);
+    return Obj::parse(node, arena);
   else
   {
     std::cerr << "Error: unexpected shape of type "
@@ -22,29 +24,42 @@ Shape* Shape::parse(tinyxml2::XMLNode* node)
   }
 }
 
-Color Shape::getColorAt(const Vec3d& surface_point) const
+Color Shape::getColorAt(const Hit& hit, double footprint) const
 {
-    const auto it = computed_color_points_.find(surface_point);
     Color c;
-    if (it == computed_color_points_.cend()) {
 
-        // avoid "unused variable 'valid' when compiled with NDEBUG
+    // avoid "unused variable 'valid' when compiled with NDEBUG
 # ifdef NDEBUG
-        computeColorFromTexture(surface_point, c);
+    computeColorFromTexture(hit, footprint, c);
 # else
-        bool valid = computeColorFromTexture(surface_point, c);
-        assert(valid);
+    bool valid = computeColorFromTexture(hit, footprint, c);
+    assert(valid);
 # endif //NDEBUG
 
-        computed_color_points_[surface_point] = c; // cache
-    }
-    else {
-        c = it->second;
-    }
     return c;
 }
 
-Sphere* Sphere::parse(tinyxml2::XMLNode* node)
+vmask Shape::intersectPacket(const RayPacket& packet, vmask active,
+                             PacketHit& hit) const
+{
+    vmask hits = splatMask(false);
+    Vec3d inter;
+    double cur_dist;
+
+    for (int i = 0; i < PACKET_SIZE; i++)
+    {
+        if (active[i] && intersect(packet.ray(i), inter, cur_dist)
+            && cur_dist < hit.dist[i])
+        {
+            hit.dist[i] = cur_dist;
+            hit.primitive[i] = -1;
+            hits[i] = -1;
+        }
+    }
+    return hits;
+}
+
+Sphere* Sphere::parse(tinyxml2::XMLNode* node, Arena& arena)
 {
   double radius = nan("");
   Vec3d pos;
@@ -64,7 +79,7 @@ Sphere* Sphere::parse(tinyxml2::XMLNode* node)
     if (is_named("vec", child) && elt->Attribute("name","pos"))
       pos = parseVec(elt);
     else if (is_named("material", child))
-      mat = Material::parse(elt);
+      mat = Material::parse(elt, arena);
     else
     {
       std::cerr << "Error: invalid node " << child->ToElement()->Name() << std::endl;
@@ -75,7 +90,7 @@ Sphere* Sphere::parse(tinyxml2::XMLNode* node)
 
   // FIXME: refl value
   std::cout << "Refl value: " << mat->get_refl() << std::endl;
-  return new Sphere(pos, *mat, radius);
+  return arena.make<Sphere>(pos, *mat, radius);
 }
 
 bool Sphere::containsPoint(const Vec3d& point) const
@@ -83,30 +98,60 @@ bool Sphere::containsPoint(const Vec3d& point) const
     return fequals(radius_, (point - center_).norm());
 }
 
-bool Sphere::computeColorFromTexture(const Vec3d& where, Color& out) const
+bool Sphere::computeColorFromTexture(const Hit& hit, double footprint,
+                                       Color& out) const
 {
+    const Vec3d& where = hit.point;
     assert(this->containsPoint(where));
 
-    if (lazy_texturing_first_point_ == nullptr)
-    {
-        lazy_texturing_first_point_ = new Vec3d{where};
-        out = material_.color_at(0, 0);
-    }
-    else
-    {
-        Vec3d center2origin = *lazy_texturing_first_point_ - center_;
-        Vec3d center2where  = where - center_;
-        Vec3d origin2where  = where - *lazy_texturing_first_point_;
-        double angle = center2origin.dot(center2where)
-            / (center2origin.norm() * center2where.norm());
-        origin2where = 1.0 / origin2where.norm() * origin2where; // normalized
-        out = material_.color_at(angle * radius_ * origin2where[0],
-                                 angle * radius_ * origin2where[1]);
-    }
+    // Longitude and latitude, as arc lengths, around the y axis
+    Vec3d d = where - center_;
+    double lat = std::max(-1., std::min(1., d[1] * inv_radius_));
+    out = material_.filtered_color_at(radius_ * std::atan2(d[2], d[0]),
+                                      radius_ * std::asin(lat), footprint);
     return true;
 }
 
-Plane* Plane::parse(tinyxml2::XMLNode* node)
+vmask Sphere::intersectPacket(const RayPacket& packet, vmask active,
+                              PacketHit& hit) const
+{
+    // Same computation as intersect, on every lane
+    vdouble o_c[3];
+    for (int i = 0; i < 3; i++)
+        o_c[i] = packet.orig[i] - splat(center_[i]);
+
+    vdouble a = packet.dir[0] * packet.dir[0] + packet.dir[1] * packet.dir[1]
+              + packet.dir[2] * packet.dir[2];
+    vdouble b = splat(2.) * (packet.dir[0] * o_c[0] + packet.dir[1] * o_c[1]
+                             + packet.dir[2] * o_c[2]);
+    vdouble c = (o_c[0] * o_c[0] + o_c[1] * o_c[1] + o_c[2] * o_c[2])
+              - splat(radius_ * radius_);
+
+    vdouble delta = b * b - splat(4.) * a * c;
+    vmask hits = active & (delta >= splat(0));
+    if (countLanes(hits) == 0)
+        return hits;
+
+    vdouble sq_delta;
+    for (int i = 0; i < PACKET_SIZE; i++)
+        sq_delta[i] = (hits[i] ? sqrt(delta[i]) : 0);
+
+    vdouble t1 = (-b - sq_delta) / (splat(2.) * a);
+    vdouble t2 = (-b + sq_delta) / (splat(2.) * a);
+
+    vmask pos1 = t1 >= splat(0);
+    vmask pos2 = t2 >= splat(0);
+    vdouble mint = (pos1 & pos2 ? vmin(t1, t2) : (pos1 ? t1 : t2));
+
+    hits &= (pos1 | pos2) & (mint < hit.dist);
+    hit.dist = (hits ? mint : hit.dist);
+    for (int i = 0; i < PACKET_SIZE; i++)
+        if (hits[i])
+            hit.primitive[i] = -1;
+    return hits;
+}
+
+Plane* Plane::parse(tinyxml2::XMLNode* node, Arena& arena)
 {
   Vec3d pos;
   Vec3d dir1;
@@ -120,7 +165,7 @@ Plane* Plane::parse(tinyxml2::XMLNode* node)
     if (is_named("vec", child) && elt->Attribute("name","pos"))
       pos = parseVec(elt);
     else if (is_named("material", child))
-      mat = Material::parse(elt);
+      mat = Material::parse(elt, arena);
     else if (is_named("vec", child) && elt->Attribute("name", "dir1"))
       dir1 = parseVec(elt);
     else if (is_named("vec", child) && elt->Attribute("name", "dir2"))
@@ -135,33 +180,17 @@ Plane* Plane::parse(tinyxml2::XMLNode* node)
   while ((child = child->NextSibling()));
 
   // FIXME: refl value
-  return new Plane(pos,dir1,dir2, *mat);
+  return arena.make<Plane>(pos,dir1,dir2, *mat);
 }
 
-bool Plane::computeColorFromTexture(const Vec3d& where, Color& out) const
+bool Plane::computeColorFromTexture(const Hit& hit, double footprint,
+                                      Color& out) const
 {
+    const Vec3d& where = hit.point;
     assert(this->containsPoint(where));
 
-    if (lazy_texturing_first_point_ == nullptr) // first time called
-    {
-        lazy_texturing_first_point_ = new Vec3d{where};
-        out = material_.color_at(0, 0);
-    }
-    else if (lazy_texturing_first_axis_ == nullptr)
-    {
-        assert(lazy_texturing_first_point_ != nullptr);
-        lazy_texturing_first_axis_ = new Vec3d{where - *lazy_texturing_first_point_};
-        double dist = lazy_texturing_first_axis_->norm();
-        out = material_.color_at(dist, 0.);
-    }
-    else
-    {
-        Vec3d b = where - *lazy_texturing_first_point_;
-        double blen = b.norm();
-        double cos = lazy_texturing_first_axis_->dot(b)
-            / (blen * lazy_texturing_first_axis_->norm());
-        out = material_.color_at(blen * cos, blen * -std::sqrt(1-cos*cos));
-    }
+    Vec3d d = where - pt1_;
+    out = material_.filtered_color_at(d.dot(tex_x_), d.dot(tex_y_), footprint);
     return true;
 }
 
@@ -170,7 +199,7 @@ bool Plane::containsPoint(const Vec3d& point) const
     return fequals(0, normal_.dot(point - pt1_));
 }
 
-Triangle* Triangle::parse(tinyxml2::XMLNode* node)
+Triangle* Triangle::parse(tinyxml2::XMLNode* node, Arena& arena)
 {
   Vec3d pt1;
   Vec3d pt2;
@@ -197,7 +226,7 @@ Triangle* Triangle::parse(tinyxml2::XMLNode* node)
       }
     }
     else if (is_named("material", child))
-      mat = Material::parse(elt);
+      mat = Material::parse(elt, arena);
     else
     {
       std::cerr << "Error: invalid node " << child->ToElement()->Name() << std::endl;
@@ -206,7 +235,48 @@ Triangle* Triangle::parse(tinyxml2::XMLNode* node)
   }
   while ((child = child->NextSibling()));
 
-  return new Triangle(pt1,pt2,pt3, *mat);
+  return arena.make<Triangle>(pt1,pt2,pt3, *mat);
+}
+
+vmask Triangle::intersectPacket(const RayPacket& packet, vmask active,
+                                PacketHit& hit) const
+{
+    // Same computation as intersect, on every lane
+    const vdouble* d = packet.dir;
+
+    vdouble p[3];
+    p[0] = d[1] * splat(e2_[2]) - d[2] * splat(e2_[1]);
+    p[1] = d[2] * splat(e2_[0]) - d[0] * splat(e2_[2]);
+    p[2] = d[0] * splat(e2_[1]) - d[1] * splat(e2_[0]);
+
+    vdouble det = splat(e1_[0]) * p[0] + splat(e1_[1]) * p[1] + splat(e1_[2]) * p[2];
+    vdouble inv_det = splat(1.) / det;
+
+    vdouble t[3];
+    for (int i = 0; i < 3; i++)
+        t[i] = packet.orig[i] - splat(pt1_[i]);
+
+    vdouble u = (t[0] * p[0] + t[1] * p[1] + t[2] * p[2]) * inv_det;
+    vmask hits = active & ~(u < splat(0)) & ~(u > splat(1));
+    if (countLanes(hits) == 0)
+        return hits;
+
+    vdouble q[3];
+    q[0] = t[1] * splat(e1_[2]) - t[2] * splat(e1_[1]);
+    q[1] = t[2] * splat(e1_[0]) - t[0] * splat(e1_[2]);
+    q[2] = t[0] * splat(e1_[1]) - t[1] * splat(e1_[0]);
+
+    vdouble v = (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]) * inv_det;
+    hits &= ~(v < splat(0)) & ~(u + v > splat(1));
+
+    vdouble t_hit = (splat(e2_[0]) * q[0] + splat(e2_[1]) * q[1]
+                     + splat(e2_[2]) * q[2]) * inv_det;
+    hits &= (t_hit >= splat(0)) & (t_hit < hit.dist);
+    hit.dist = (hits ? t_hit : hit.dist);
+    for (int i = 0; i < PACKET_SIZE; i++)
+        if (hits[i])
+            hit.primitive[i] = -1;
+    return hits;
 }
 
 bool Triangle::containsPoint(const Vec3d& point) const
@@ -231,29 +301,15 @@ bool Triangle::containsPoint(const Vec3d& point) const
     return (u >= 0) && (v >= 0) && (u + v <= 1);
 }
 
-bool Triangle::computeColorFromTexture(const Vec3d& where, Color& out) const
+bool Triangle::computeColorFromTexture(const Hit& hit, double footprint,
+                                         Color& out) const
 {
+    const Vec3d& where = hit.point;
     assert(this->containsPoint(where));
 
-    if (lazy_texturing_first_point_ == nullptr) // first time called
-    {
-        lazy_texturing_first_point_ = new Vec3d{where};
-        out = material_.color_at(0, 0);
-    }
-    else if (lazy_texturing_first_axis_ == nullptr)
-    {
-        assert(lazy_texturing_first_point_ != nullptr);
-        lazy_texturing_first_axis_ = new Vec3d{where - *lazy_texturing_first_point_};
-        double dist = lazy_texturing_first_axis_->norm();
-        out = material_.color_at(dist, 0.);
-    }
-    else
-    {
-        Vec3d b = where - *lazy_texturing_first_point_;
-        double blen = b.norm();
-        double cos = lazy_texturing_first_axis_->dot(b)
-            / (blen * lazy_texturing_first_axis_->norm());
-        out = material_.color_at(blen * cos, blen * -std::sqrt(1-cos*cos));
-    }
+    double x;
+    double y;
+    textureCoords(where, x, y);
+    out = material_.filtered_color_at(x, y, footprint);
     return true;
 }
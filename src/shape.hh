@@ -1,45 +1,102 @@
 #ifndef SHAPE_HH_
 # define SHAPE_HH_
 
-#include <unordered_map>
+#include "arena.hh"
 #include "ray.hh"
 #include "utils.hh"
 #include "color.hh"
 #include "material.hh"
 #include "bbox.hh"
+#include "hit.hh"
+#include "packet.hh"
 #include "vector.hh"
 
+class KDTree;
+
 // Abstract class shape
 class Shape
 {
   public:
-    static Shape* parse(tinyxml2::XMLNode* node);
-
-    ~Shape() { delete lazy_texturing_first_point_; }
+    // Parses a shape, allocated with its material in arena
+    static Shape* parse(tinyxml2::XMLNode* node, Arena& arena);
 
     // Returns the normal to a shape at the point of intersection, or a null
     // pointer otherwise
     virtual bool intersect(Ray ray, Vec3d& intersect, double& dist) const = 0;
 
-    // The normal vector to a shape at the intersection point pt
-    virtual Vec3d normal(Ray& ray) = 0;
+    // Same as intersect, while looking for the closest hit: if ray hits the
+    // shape closer than hit.dist, sets the distance, the point and the
+    // primitive of hit and returns true. The shape of hit is set by the
+    // caller.
+    virtual bool intersect(const Ray& ray, Hit& hit) const
+    {
+      Vec3d inter;
+      double dist;
+      if (!intersect(ray, inter, dist) || dist >= hit.dist)
+        return false;
+
+      hit.dist = dist;
+      hit.point = inter;
+      hit.primitive = -1;
+      return true;
+    }
+
+    // Returns true if the ray hits the shape closer than max_dist. Shapes made
+    // of several primitives may stop at the first hit found.
+    virtual bool occludes(const Ray& ray, double max_dist) const
+    {
+      Vec3d inter;
+      double dist;
+      return intersect(ray, inter, dist) && dist < max_dist;
+    }
+
+    // Packet version of intersect: returns the lanes of active that hit the
+    // shape closer than hit.dist, and lowers hit.dist to the hit distance and
+    // sets hit.primitive for those lanes. By default every lane is
+    // intersected on its own.
+    virtual vmask intersectPacket(const RayPacket& packet, vmask active,
+                                  PacketHit& hit) const;
+
+    // Packet version of occludes: returns the lanes of active that hit the
+    // shape closer than max_dist
+    virtual vmask occludesPacket(const RayPacket& packet, vmask active,
+                                 vdouble max_dist) const
+    {
+      PacketHit hit;
+      hit.dist = max_dist;
+      return intersectPacket(packet, active, hit);
+    }
+
+    // The tree of the triangles of the shape if it is an instance of a mesh,
+    // nullptr otherwise. The KDTree of the scene goes down into it itself,
+    // with the rays mapped by toInstance, instead of calling intersect.
+    virtual const KDTree* instanceTree() const {return nullptr;}
+
+    virtual Ray toInstance(const Ray& ray) const {return ray;}
+
+    // Sets the normals of hit, the closest hit of ray on this shape, and its
+    // barycentric coordinates if it is in a mesh
+    virtual void completeHit(const Ray& ray, Hit& hit) const = 0;
 
     BBox getBBox() const {return bbox_;}
 
-    /* Returns the Color at this Shape's surface_point.
-     * Be sure that surface_point really is contained by this Shape!
+    /* Returns the Color at the point of hit, which must be on this Shape.
+     * The texture frame of a shape is computed when it is built, so this
+     * method may be called concurrently.
+     * footprint is the width of the surface seen through one pixel, see
+     * Material::filtered_color_at.
      */
-    Color getColorAt(const Vec3d& surface_point) const;
-
-    /* Given a point (where), compute the shape's color at that point
-     * according to the texture described in material_. If the point is
-     * located on the Shape's surface, this method returns true and set its
-     * out argument to the appropriate color; otherwise, false is returned and
-     * out is not changed.
-     * This method does not update computed_color_points_: this is
-     * getColorAt's job.
+    Color getColorAt(const Hit& hit, double footprint = 0) const;
+
+    /* Given a hit, compute the shape's color at its point according to the
+     * texture described in material_. If the point is located on the
+     * Shape's surface, this method returns true and set its out argument to
+     * the appropriate color; otherwise, false is returned and out is not
+     * changed.
+     * This method does not modify the Shape.
      */
-    virtual bool computeColorFromTexture(const Vec3d& where, Color& out) const = 0;
+    virtual bool computeColorFromTexture(const Hit& hit, double footprint,
+                                         Color& out) const = 0;
 
     /* Returns true iff pt is part of this shape's surface. */
     virtual bool containsPoint(const Vec3d& pt) const = 0;
@@ -51,59 +108,30 @@ class Shape
 
     Vec3d center(void) const {return center_;}
 
-    Ray reflect(Ray ray)
-    {
-      Ray op_ray = ray.op_dir();
-      Vec3d normal_dir = this->normal(op_ray);
-      // Direction of the reflected vector
-      Vec3d refl_dir = ray.dir() - 2.0 * normal_dir * ray.dir().dot(normal_dir);
-      //
-      // Because of the double imprecision, we have to shift the reflected ray out
-      // of the shape. Still, something smells fishy, I think something wrong is
-      // done somewhere.
-      const double shift = std::numeric_limits<double>::epsilon() * 65536.0;
-
-      return Ray (ray.orig() + normal_dir * shift, normalize(refl_dir));
-    }
-
   protected:
-    Shape(Material& mat)
+    // The material is shared, not copied: it must outlive the shape, which it
+    // does when both belong to the same Arena
+    Shape(const Material& mat)
         : material_(mat)
-        , lazy_texturing_first_point_(nullptr)
     {}
 
-    Material material_;
+    const Material& material_;
     Vec3d center_;
     BBox bbox_;
-
-    /* First point of the shape for which a color has been computed (from a
-     * texture). The first point is attributed the origin (0,0) of the
-     * attached texture (material_). According to the relevant shape
-     * specialization (Sphere, Plane, etc.), color of further points is
-     * computed relatively to this first point.
-     * If the first point has not been computed, this attribute is nullptr.
-     */
-    mutable Vec3d* lazy_texturing_first_point_;
-
-    /* This map holds the color values for points that already have been
-     * required. Since the texture does not change between successive rays,
-     * there is no use of re-compute a point's color value according to the
-     * texture of the Material attached to the Shape, so we cache that color.
-     */
-    mutable std::unordered_map<Vec3d,Color> computed_color_points_;
 };
 
 class Sphere : public Shape
 {
   public:
-    static Sphere* parse(tinyxml2::XMLNode* node);
+    static Sphere* parse(tinyxml2::XMLNode* node, Arena& arena);
 
-    Sphere(Vec3d c, Material& mat, double r)
+    Sphere(Vec3d c, const Material& mat, double r)
         : Shape(mat), radius_(r)
     {
       center_ = c;
       Vec3d radVec (radius_, radius_, radius_);
       bbox_ = BBox(center_ - radVec, center_ + radVec);
+      inv_radius_ = 1. / radius_;
     }
 
     bool intersect(Ray ray, Vec3d& intersect, double& dist) const
@@ -143,25 +171,32 @@ class Sphere : public Shape
         return false;
     }
 
-    Vec3d normal(Ray& ray)
+    vmask intersectPacket(const RayPacket& packet, vmask active,
+                          PacketHit& hit) const override;
+
+    void completeHit(const Ray&, Hit& hit) const override
     {
-      return normalize(ray.orig() - center_);
+      hit.normal = normalize(hit.point - center_);
+      hit.shading_normal = hit.normal;
+      hit.two_sided = false;
     }
 
     bool containsPoint(const Vec3d& point) const override;
 
   private:
-    bool computeColorFromTexture(const Vec3d& where, Color& out) const override;
+    bool computeColorFromTexture(const Hit& hit, double footprint,
+                                 Color& out) const override;
 
     double radius_;
+    double inv_radius_;
 };
 
 class Plane : public Shape
 {
   public:
-    static Plane* parse(tinyxml2::XMLNode* node);
+    static Plane* parse(tinyxml2::XMLNode* node, Arena& arena);
 
-    Plane(Vec3d pt1, Vec3d dir1, Vec3d dir2, Material& mat)
+    Plane(Vec3d pt1, Vec3d dir1, Vec3d dir2, const Material& mat)
     : Shape(mat), pt1_(pt1), dir1_(dir1), dir2_(dir2)
     {
       normal_ = normalize(dir1.cross(dir2));
@@ -172,9 +207,11 @@ class Plane : public Shape
 
       bbox_ = BBox(minPt, maxPt);
       center_ = pt1;
-    }
 
-    ~Plane() { delete lazy_texturing_first_axis_; }
+      // The texture starts at pt1 and its x axis follows dir1
+      tex_x_ = normalize(dir1);
+      tex_y_ = normal_.cross(tex_x_);
+    }
 
     bool intersect(Ray ray, Vec3d& intersect, double& dist) const
     {
@@ -192,30 +229,35 @@ class Plane : public Shape
         return false;
     }
 
-    Vec3d normal(Ray& ray)
+    void completeHit(const Ray&, Hit& hit) const override
     {
-      return (normal_.dot(ray.dir()) < 0 ? -normal_ : normal_);
+      hit.normal = normal_;
+      hit.shading_normal = normal_;
+      hit.two_sided = true;
     }
 
     bool containsPoint(const Vec3d& point) const override;
 
   protected:
-    bool computeColorFromTexture(const Vec3d& where, Color& out) const override;
+    bool computeColorFromTexture(const Hit& hit, double footprint,
+                                 Color& out) const override;
 
     Vec3d pt1_;
     Vec3d dir1_;
     Vec3d dir2_;
     Vec3d normal_;
 
-    mutable Vec3d* lazy_texturing_first_axis_ = nullptr;
+    // Axes of the texture in the plane
+    Vec3d tex_x_;
+    Vec3d tex_y_;
 };
 
 class Triangle : public Shape
 {
   public:
-    static Triangle* parse(tinyxml2::XMLNode* node);
+    static Triangle* parse(tinyxml2::XMLNode* node, Arena& arena);
 
-    Triangle(Vec3d pt1, Vec3d pt2, Vec3d pt3, Material& mat)
+    Triangle(Vec3d pt1, Vec3d pt2, Vec3d pt3, const Material& mat)
       : Shape(mat), pt1_(pt1), pt2_(pt2), pt3_(pt3)
       {
         normal_ = normalize((pt3_ - pt2_).cross(pt1_ - pt3_));
@@ -226,9 +268,11 @@ class Triangle : public Shape
         // The edges of the triangles
         e1_ = (pt2_ - pt1_);
         e2_ = (pt3_ - pt1_);
-      }
 
-    ~Triangle() { delete lazy_texturing_first_axis_; }
+        // The texture starts at pt1 and its x axis follows the first edge
+        tex_x_ = normalize(e1_);
+        tex_y_ = normal_.cross(tex_x_);
+      }
 
     bool intersect(Ray ray, Vec3d& intersect, double& dist) const
     {
@@ -255,14 +299,28 @@ class Triangle : public Shape
         return false;
     }
 
-    Vec3d normal(Ray& ray)
+    vmask intersectPacket(const RayPacket& packet, vmask active,
+                          PacketHit& hit) const override;
+
+    void completeHit(const Ray&, Hit& hit) const override
     {
-      return (normal_.dot(ray.dir()) < 0 ? -normal_ : normal_);
+      hit.normal = normal_;
+      hit.shading_normal = normal_;
+      hit.two_sided = true;
     }
 
     bool containsPoint(const Vec3d& point) const override;
+
     Vec3d getNormal() {return normal_;}
 
+    // Coordinates of point in the texture frame of the triangle
+    void textureCoords(const Vec3d& point, double& x, double& y) const
+    {
+      Vec3d d = point - pt1_;
+      x = d.dot(tex_x_);
+      y = d.dot(tex_y_);
+    }
+
   protected:
     // A triangle is defined by 3 points in the space
     Vec3d pt1_;
@@ -276,25 +334,13 @@ class Triangle : public Shape
     // precompute it
     Vec3d normal_;
 
-    mutable Vec3d* lazy_texturing_first_axis_ = nullptr;
-
-    std::pair<double,double> getBarycentric(Ray ray)
-    {
-      Vec3d p = ray.dir().cross(e2_);
-      double det = e1_.dot(p);
-      double inv_det = 1. / det;
-
-      Vec3d t = ray.orig() - pt1_;
-      double u = t.dot(p) * inv_det;
-
-      Vec3d q = t.cross(e1_);
-      double v = ray.dir().dot(q) * inv_det;
-
-      return std::pair<double,double>(u,v);
-    }
+    // Axes of the texture in the plane of the triangle
+    Vec3d tex_x_;
+    Vec3d tex_y_;
 
   private:
-    bool computeColorFromTexture(const Vec3d& where, Color& out) const override;
+    bool computeColorFromTexture(const Hit& hit, double footprint,
+                                 Color& out) const override;
 };
 
 #endif
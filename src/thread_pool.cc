@@ -0,0 +1,140 @@
+#include "thread_pool.hh"
+
+// The pool and the index of the worker running on the current thread, used by
+// push to keep the tasks spawned by a worker in its own deque.
+static thread_local const ThreadPool* current_pool = nullptr;
+static thread_local unsigned int current_worker = 0;
+
+ThreadPool::ThreadPool(unsigned int threads)
+  : queued_(0), unfinished_(0), next_queue_(0), stop_(false)
+{
+  if (threads == 0)
+    threads = hardwareThreads();
+
+  for (unsigned int i = 0; i < threads; i++)
+    queues_.push_back(std::unique_ptr<Queue>(new Queue()));
+
+  for (unsigned int i = 0; i < threads; i++)
+    workers_.push_back(std::thread(&ThreadPool::work, this, i));
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(wake_lock_);
+    stop_ = true;
+  }
+  wake_.notify_all();
+
+  for (auto& w : workers_)
+    w.join();
+}
+
+unsigned int ThreadPool::hardwareThreads()
+{
+  unsigned int n = std::thread::hardware_concurrency();
+  return (n == 0 ? 1 : n);
+}
+
+void ThreadPool::push(Task task)
+{
+  unsigned int q;
+  if (current_pool == this)
+    q = current_worker;
+  else
+    q = next_queue_++ % queues_.size();
+
+  unfinished_++;
+  {
+    // Incremented under wake_lock_ so that a worker can not miss the wake up,
+    // and before the task can be popped so that queued_ never goes below 0
+    std::lock_guard<std::mutex> lock(wake_lock_);
+    queued_++;
+  }
+  {
+    std::lock_guard<std::mutex> lock(queues_[q]->lock);
+    queues_[q]->tasks.push_back(std::move(task));
+  }
+  wake_.notify_one();
+}
+
+bool ThreadPool::pop(unsigned int self, Task& task)
+{
+  {
+    std::lock_guard<std::mutex> lock(queues_[self]->lock);
+    if (!queues_[self]->tasks.empty())
+    {
+      task = std::move(queues_[self]->tasks.back());
+      queues_[self]->tasks.pop_back();
+      queued_--;
+      return true;
+    }
+  }
+
+  for (unsigned int i = 1; i < queues_.size(); i++)
+  {
+    Queue& victim = *queues_[(self + i) % queues_.size()];
+    std::lock_guard<std::mutex> lock(victim.lock);
+    if (!victim.tasks.empty())
+    {
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      queued_--;
+      return true;
+    }
+  }
+  return false;
+}
+
+void ThreadPool::run(Task& task)
+{
+  task();
+  if (--unfinished_ == 0)
+  {
+    std::lock_guard<std::mutex> lock(wake_lock_);
+    done_.notify_all();
+  }
+}
+
+void ThreadPool::work(unsigned int self)
+{
+  current_pool = this;
+  current_worker = self;
+
+  for (;;)
+  {
+    Task task;
+    if (pop(self, task))
+    {
+      run(task);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(wake_lock_);
+    wake_.wait(lock, [this] {return stop_ || queued_ > 0;});
+    if (stop_ && queued_ == 0)
+      return;
+  }
+}
+
+void ThreadPool::wait()
+{
+  std::unique_lock<std::mutex> lock(wake_lock_);
+  done_.wait(lock, [this] {return unfinished_ == 0;});
+}
+
+void ThreadPool::helpUntil(const std::atomic<bool>& done)
+{
+  // Outside of the pool, the calling thread steals starting from the first
+  // deque
+  unsigned int self = (current_pool == this ? current_worker : 0);
+
+  while (!done)
+  {
+    Task task;
+    if (pop(self, task))
+      run(task);
+    else
+      std::this_thread::yield();
+  }
+}
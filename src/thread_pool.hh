@@ -0,0 +1,75 @@
+#ifndef THREAD_POOL_HH_
+# define THREAD_POOL_HH_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed size pool of worker threads with work stealing.
+// Every worker owns a deque of tasks: it pops its own tasks from the back, and
+// when it runs out of work it steals from the front of the other deques. Tasks
+// pushed from outside of the pool are dealt round-robin to the workers.
+class ThreadPool
+{
+  public:
+    typedef std::function<void()> Task;
+
+    // A thread count of 0 means one worker per hardware thread
+    explicit ThreadPool(unsigned int threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Queues a task. When called from a worker, the task goes to the deque of
+    // this worker.
+    void push(Task task);
+
+    // Blocks until every pushed task has been run
+    void wait();
+
+    // Runs queued tasks on the calling thread until done is set. A task
+    // waiting for the tasks it pushed uses it instead of wait, so that the
+    // worker running it keeps working instead of blocking.
+    void helpUntil(const std::atomic<bool>& done);
+
+    unsigned int size() const {return workers_.size();}
+
+    static unsigned int hardwareThreads();
+
+  private:
+    struct Queue
+    {
+      std::mutex lock;
+      std::deque<Task> tasks;
+    };
+
+    // Pops a task from the deque of worker self, or steals one from another
+    // worker. Returns false if every deque is empty.
+    bool pop(unsigned int self, Task& task);
+
+    // Runs a popped task and signals wait if it was the last one
+    void run(Task& task);
+
+    void work(unsigned int self);
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> workers_;
+
+    // Tasks pushed but not popped yet, and tasks pushed but not finished yet
+    std::atomic<unsigned int> queued_;
+    std::atomic<unsigned int> unfinished_;
+    std::atomic<unsigned int> next_queue_;
+
+    std::mutex wake_lock_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    bool stop_;
+};
+
+#endif
@@ -0,0 +1,315 @@
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include "triangle_block.hh"
+#include "mesh.hh"
+
+// In single precision, the hits found in the block are only candidates: the
+// barycentric coordinates and the distances are tested with a tolerance, and
+// the candidates are intersected again in double.
+static const bool refine = sizeof (accel_t) < sizeof (double);
+static const accel_t tolerance =
+  (refine ? 64 * std::numeric_limits<accel_t>::epsilon() : 0);
+
+// Loads TRIANGLE_BLOCK_WIDTH consecutive values, which do not have to be
+// aligned
+static inline vaccel load(const accel_t* ptr)
+{
+  vaccel ret;
+  std::memcpy(&ret, ptr, sizeof (ret));
+  return ret;
+}
+
+static inline vaccel broadcast(accel_t val)
+{
+  vaccel ret;
+  for (unsigned int i = 0; i < TRIANGLE_BLOCK_WIDTH; i++)
+    ret[i] = val;
+  return ret;
+}
+
+void TriangleBlock::setArrays(const accel_t* data)
+{
+  uint32_t stride = TriangleBlock::stride(size_);
+  for (int k = 0; k < 3; k++)
+  {
+    pt1_[k] = data + k * stride;
+    e1_[k] = data + (3 + k) * stride;
+    e2_[k] = data + (6 + k) * stride;
+  }
+}
+
+void TriangleBlock::build(const Mesh& mesh)
+{
+  size_ = mesh.size();
+
+  uint32_t stride = TriangleBlock::stride(size_);
+  std::shared_ptr<Array> storage = std::make_shared<Array>(9 * stride, 0);
+  accel_t* data = storage->data();
+
+  for (uint32_t i = 0; i < size_; i++)
+  {
+    Vec3d pt1 = mesh.vertex(i, 0);
+    Vec3d e1 = mesh.vertex(i, 1) - pt1;
+    Vec3d e2 = mesh.vertex(i, 2) - pt1;
+    for (int k = 0; k < 3; k++)
+    {
+      data[k * stride + i] = pt1[k];
+      data[(3 + k) * stride + i] = e1[k];
+      data[(6 + k) * stride + i] = e2[k];
+    }
+  }
+
+  setArrays(data);
+  storage_ = storage;
+  mesh_ = &mesh;
+}
+
+void TriangleBlock::map(const accel_t* data, const Mesh& mesh,
+                        std::shared_ptr<const void> storage)
+{
+  size_ = mesh.size();
+  setArrays(data);
+  storage_ = storage;
+  mesh_ = &mesh;
+}
+
+vaccel_mask TriangleBlock::intersectLanes(const Ray& ray, uint32_t first,
+                                          vaccel& dist) const
+{
+  // Same computation as Triangle::intersect, the ray being the same on every
+  // lane
+  Vec3d o = ray.orig();
+  Vec3d d = ray.dir();
+
+  vaccel e1[3];
+  vaccel e2[3];
+  for (int k = 0; k < 3; k++)
+  {
+    e1[k] = load(&e1_[k][first]);
+    e2[k] = load(&e2_[k][first]);
+  }
+
+  vaccel p[3];
+  p[0] = broadcast(d[1]) * e2[2] - broadcast(d[2]) * e2[1];
+  p[1] = broadcast(d[2]) * e2[0] - broadcast(d[0]) * e2[2];
+  p[2] = broadcast(d[0]) * e2[1] - broadcast(d[1]) * e2[0];
+
+  vaccel det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+  vaccel inv_det = broadcast(1) / det;
+
+  vaccel t[3];
+  for (int k = 0; k < 3; k++)
+    t[k] = broadcast(o[k]) - load(&pt1_[k][first]);
+
+  const vaccel low = broadcast(-tolerance);
+  const vaccel high = broadcast(1 + tolerance);
+
+  vaccel u = (t[0] * p[0] + t[1] * p[1] + t[2] * p[2]) * inv_det;
+  vaccel_mask hits = ~(u < low) & ~(u > high);
+  bool any = false;
+  for (unsigned int i = 0; i < TRIANGLE_BLOCK_WIDTH; i++)
+    any = any || hits[i];
+  if (!any)
+  {
+    dist = broadcast(0);
+    return hits;
+  }
+
+  vaccel q[3];
+  q[0] = t[1] * e1[2] - t[2] * e1[1];
+  q[1] = t[2] * e1[0] - t[0] * e1[2];
+  q[2] = t[0] * e1[1] - t[1] * e1[0];
+
+  vaccel v = (broadcast(d[0]) * q[0] + broadcast(d[1]) * q[1] + broadcast(d[2]) * q[2]) * inv_det;
+  hits &= ~(v < low) & ~(u + v > high);
+
+  dist = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * inv_det;
+  hits &= dist >= low;
+  return hits;
+}
+
+int TriangleBlock::intersect(const Ray& ray, uint32_t first, uint32_t count,
+                             double& dist) const
+{
+  int best = -1;
+
+  for (uint32_t i = first; i < first + count; i += TRIANGLE_BLOCK_WIDTH)
+  {
+    vaccel cur_dist;
+    vaccel_mask hits = intersectLanes(ray, i, cur_dist);
+
+    uint32_t lanes = std::min<uint32_t>(TRIANGLE_BLOCK_WIDTH, first + count - i);
+    for (uint32_t l = 0; l < lanes; l++)
+    {
+      if (!hits[l])
+        continue;
+
+      if (!refine)
+      {
+        if (cur_dist[l] < dist)
+        {
+          dist = cur_dist[l];
+          best = i + l;
+        }
+        continue;
+      }
+
+      double exact;
+      if (cur_dist[l] <= dist * (1 + tolerance)
+          && mesh_->intersect(i + l, ray, exact) && exact < dist)
+      {
+        dist = exact;
+        best = i + l;
+      }
+    }
+  }
+  return best;
+}
+
+bool TriangleBlock::occludes(const Ray& ray, uint32_t first, uint32_t count,
+                             double max_dist) const
+{
+  for (uint32_t i = first; i < first + count; i += TRIANGLE_BLOCK_WIDTH)
+  {
+    vaccel cur_dist;
+    vaccel_mask hits = intersectLanes(ray, i, cur_dist);
+
+    uint32_t lanes = std::min<uint32_t>(TRIANGLE_BLOCK_WIDTH, first + count - i);
+    for (uint32_t l = 0; l < lanes; l++)
+    {
+      if (!hits[l])
+        continue;
+
+      if (!refine)
+      {
+        if (cur_dist[l] < max_dist)
+          return true;
+      }
+      else
+      {
+        double exact;
+        if (cur_dist[l] <= max_dist * (1 + tolerance)
+            && mesh_->intersect(i + l, ray, exact) && exact < max_dist)
+          return true;
+      }
+    }
+  }
+  return false;
+}
+
+vmask TriangleBlock::intersectLanes(const RayPacket& packet, vmask active,
+                                    uint32_t t, vdouble& dist) const
+{
+  const vdouble* d = packet.dir;
+
+  vdouble e1[3];
+  vdouble e2[3];
+  for (int k = 0; k < 3; k++)
+  {
+    e1[k] = splat(e1_[k][t]);
+    e2[k] = splat(e2_[k][t]);
+  }
+
+  vdouble p[3];
+  p[0] = d[1] * e2[2] - d[2] * e2[1];
+  p[1] = d[2] * e2[0] - d[0] * e2[2];
+  p[2] = d[0] * e2[1] - d[1] * e2[0];
+
+  vdouble det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+  vdouble inv_det = splat(1.) / det;
+
+  vdouble o[3];
+  for (int k = 0; k < 3; k++)
+    o[k] = packet.orig[k] - splat(pt1_[k][t]);
+
+  const vdouble low = splat(-tolerance);
+  const vdouble high = splat(1 + tolerance);
+
+  vdouble u = (o[0] * p[0] + o[1] * p[1] + o[2] * p[2]) * inv_det;
+  vmask hits = active & ~(u < low) & ~(u > high);
+  if (countLanes(hits) == 0)
+    return hits;
+
+  vdouble q[3];
+  q[0] = o[1] * e1[2] - o[2] * e1[1];
+  q[1] = o[2] * e1[0] - o[0] * e1[2];
+  q[2] = o[0] * e1[1] - o[1] * e1[0];
+
+  vdouble v = (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]) * inv_det;
+  hits &= ~(v < low) & ~(u + v > high);
+
+  dist = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * inv_det;
+  hits &= dist >= low;
+  return hits;
+}
+
+void TriangleBlock::intersect(const RayPacket& packet, vmask active,
+                              uint32_t first, uint32_t count,
+                              PacketHit& hit) const
+{
+  for (uint32_t t = first; t < first + count; t++)
+  {
+    vdouble cur_dist;
+    vmask hits = intersectLanes(packet, active, t, cur_dist);
+
+    for (int i = 0; i < PACKET_SIZE; i++)
+    {
+      if (!hits[i])
+        continue;
+
+      if (!refine)
+      {
+        if (cur_dist[i] < hit.dist[i])
+        {
+          hit.dist[i] = cur_dist[i];
+          hit.index[i] = t;
+        }
+        continue;
+      }
+
+      double exact;
+      if (cur_dist[i] <= hit.dist[i] * (1 + tolerance)
+          && mesh_->intersect(t, packet.ray(i), exact) && exact < hit.dist[i])
+      {
+        hit.dist[i] = exact;
+        hit.index[i] = t;
+      }
+    }
+  }
+}
+
+vmask TriangleBlock::occludes(const RayPacket& packet, vmask active,
+                              uint32_t first, uint32_t count,
+                              vdouble max_dist) const
+{
+  vmask occluded = splatMask(false);
+
+  for (uint32_t t = first; t < first + count; t++)
+  {
+    vdouble cur_dist;
+    vmask hits = intersectLanes(packet, active & ~occluded, t, cur_dist);
+
+    for (int i = 0; i < PACKET_SIZE; i++)
+    {
+      if (!hits[i])
+        continue;
+
+      if (!refine)
+      {
+        if (cur_dist[i] < max_dist[i])
+          occluded[i] = -1;
+        continue;
+      }
+
+      double exact;
+      if (cur_dist[i] <= max_dist[i] * (1 + tolerance)
+          && mesh_->intersect(t, packet.ray(i), exact) && exact < max_dist[i])
+        occluded[i] = -1;
+    }
+
+    if (countLanes(active & ~occluded) == 0)
+      break;
+  }
+  return occluded;
+}
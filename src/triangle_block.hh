@@ -0,0 +1,102 @@
+#ifndef TRIANGLE_BLOCK_HH_
+# define TRIANGLE_BLOCK_HH_
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "aligned_allocator.hh"
+#include "packet.hh"
+#include "ray.hh"
+
+class Mesh;
+
+// Number of triangles intersected at once: the number of accel_t in a 32
+// bytes vector
+#define TRIANGLE_BLOCK_WIDTH (32 / sizeof (accel_t))
+
+typedef accel_t vaccel __attribute__ ((vector_size (32)));
+typedef decltype (vaccel() < vaccel()) vaccel_mask;
+
+// The triangles of a mesh stored as a structure of arrays (first point and
+// both edges, one array per coordinate, in accel_t), so that a ray is
+// intersected with TRIANGLE_BLOCK_WIDTH consecutive triangles at once.
+// In single precision, the hits found in the block are candidates checked
+// again in double with the triangles of the mesh.
+class TriangleBlock
+{
+  public:
+    // Packs the triangles of mesh, in their order
+    void build(const Mesh& mesh);
+
+    // Uses the arrays already packed by build at data (see data()) instead of
+    // packing them again; storage keeps them alive
+    void map(const accel_t* data, const Mesh& mesh,
+             std::shared_ptr<const void> storage);
+
+    // The nine arrays, one after the other: the x, y and z coordinates of the
+    // first points, then of the first edges and of the second edges. Each of
+    // them holds stride(size) values.
+    const accel_t* data() const {return pt1_[0];}
+
+    uint32_t size() const {return size_;}
+
+    // Number of values of each array: the arrays are padded so that the last
+    // lanes can always be loaded, and so that they all start on a 32 bytes
+    // boundary
+    static uint32_t stride(uint32_t size)
+    {
+      return (size + 2 * TRIANGLE_BLOCK_WIDTH - 2)
+             / TRIANGLE_BLOCK_WIDTH * TRIANGLE_BLOCK_WIDTH;
+    }
+
+    bool empty() const {return size_ == 0;}
+
+    // Returns the index of the closest triangle of [first, first + count[ hit
+    // by ray closer than dist, and sets dist to the hit distance; returns -1
+    // if there is no such triangle.
+    int intersect(const Ray& ray, uint32_t first, uint32_t count, double& dist) const;
+
+    // Returns true if a triangle of [first, first + count[ is hit by ray
+    // closer than max_dist
+    bool occludes(const Ray& ray, uint32_t first, uint32_t count, double max_dist) const;
+
+    // Packet versions of intersect and occludes, for the active lanes: the
+    // packet is intersected with one triangle at a time. intersect updates
+    // the distance and the index of the lanes which hit a closer triangle;
+    // occludes returns the lanes which are occluded.
+    void intersect(const RayPacket& packet, vmask active, uint32_t first,
+                   uint32_t count, PacketHit& hit) const;
+    vmask occludes(const RayPacket& packet, vmask active, uint32_t first,
+                   uint32_t count, vdouble max_dist) const;
+
+  private:
+    // Möller-Trumbore on the TRIANGLE_BLOCK_WIDTH triangles starting at
+    // first: returns the lanes hit by the ray, with their distance in dist
+    inline vaccel_mask intersectLanes(const Ray& ray, uint32_t first,
+                                      vaccel& dist) const;
+
+    // Same as Triangle::intersectPacket on the triangle t, without the test
+    // against the current distance: returns the active lanes which hit it,
+    // with their distance in dist
+    inline vmask intersectLanes(const RayPacket& packet, vmask active,
+                                uint32_t t, vdouble& dist) const;
+
+    // Points the arrays into data
+    void setArrays(const accel_t* data);
+
+    typedef std::vector<accel_t, AlignedAllocator<accel_t, 32>> Array;
+
+    uint32_t size_ = 0;
+
+    // The arrays point either into an Array built by build, or into a mapped
+    // mesh cache; storage_ keeps them alive
+    const accel_t* pt1_[3];
+    const accel_t* e1_[3];
+    const accel_t* e2_[3];
+    std::shared_ptr<const void> storage_;
+
+    // The mesh itself, to refine the hits in single precision
+    const Mesh* mesh_ = nullptr;
+};
+
+#endif
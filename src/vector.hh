@@ -61,6 +61,63 @@ class Vector
 };
 
 
+// The three dimensional vectors, used by all the geometry, are stored in four
+// lanes (the last one being padding) of a compiler vector, so that their
+// arithmetic is done with SSE/AVX instructions. They are only aligned on 16
+// bytes, which is what new and the default allocators guarantee.
+template <typename type>
+class Vector<type,3>
+{
+  public:
+    typedef type Lanes __attribute__ ((vector_size (4 * sizeof (type)), aligned (16)));
+
+    Vector(type coord[]) : lanes_(Lanes{coord[0], coord[1], coord[2], 0}) {}
+
+    // Zeroed, so that the coordinates can be set one by one
+    Vector() : lanes_(Lanes{0, 0, 0, 0}) {}
+
+    Vector(type a, type b, type c) : lanes_(Lanes{a, b, c, 0}) {}
+
+    explicit Vector(Lanes lanes) : lanes_(lanes) {}
+
+    type& operator[] (unsigned int index)
+    {
+      return lanes_[index];
+    }
+
+    const type& operator[] (unsigned int index) const
+    {
+      return lanes_[index];
+    }
+
+    const Lanes& lanes() const {return lanes_;}
+
+    inline type norm() const;
+
+    inline type dot(const Vector& a) const;
+
+    bool operator<(const Vector& a) const
+    {
+      for (unsigned int i = 0; i < 3; i++)
+      {
+        if (lanes_[i] < a[i])
+          return true;
+      }
+      return false;
+    }
+
+    // Returns the distance between two points
+    type dist(Vector a)
+    {
+      return (*this - a).norm();
+    }
+
+    inline Vector cross(Vector a) const;
+
+  private:
+    Lanes lanes_;
+};
+
 template <typename type, std::size_t dim>
 inline Vector<type,dim> operator+(Vector<type,dim> a, Vector<type,dim> b);
 
@@ -79,22 +136,44 @@ inline Vector<type,dim> operator-(Vector<type,dim> a);
 template <typename type, std::size_t dim>
 inline bool operator==(const Vector<type,dim>& a, const Vector<type,dim>& b);
 
-typedef Vector<double,3> Vec3d;
+template <typename type>
+inline Vector<type,3> operator+(Vector<type,3> a, Vector<type,3> b);
 
-namespace std
-{
+template <typename type>
+inline Vector<type,3> operator-(Vector<type,3> a, Vector<type,3> b);
 
-    template<>
-    struct hash<Vec3d>
-    {
-        size_t operator()(const ::Vec3d& v) const noexcept
-        {
-            hash<double> h;
-            return h(v[0]) ^ h(v[1]) ^ h(v[2]);
-        }
-    };
-
-} // namespace std
+template <typename type>
+inline Vector<type,3> operator*(Vector<type,3> a, type b);
+
+template <typename type>
+inline Vector<type,3> operator*(type a, Vector<type,3> b);
+
+template <typename type>
+inline Vector<type,3> operator-(Vector<type,3> a);
+
+template <typename type>
+inline bool operator==(const Vector<type,3>& a, const Vector<type,3>& b);
+
+// Component-wise minimum and maximum of 3D vectors. Like std::min and
+// std::max, they return a when one of the values is NaN.
+template <typename type>
+inline Vector<type,3> vmin(Vector<type,3> a, Vector<type,3> b);
+
+template <typename type>
+inline Vector<type,3> vmax(Vector<type,3> a, Vector<type,3> b);
+
+typedef Vector<double,3> Vec3d;
+typedef Vector<float,3> Vec3f;
+
+// Precision of the acceleration structures, that is the boxes of the KDTree
+// nodes and the packed triangles of the meshes: float when built with
+// CRAY_SINGLE_PRECISION, double otherwise. The hits found with them are
+// refined in double, and shading is always done in double.
+#ifdef CRAY_SINGLE_PRECISION
+typedef float accel_t;
+#else
+typedef double accel_t;
+#endif
 
 #include "vector.hxx"
 
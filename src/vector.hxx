@@ -93,4 +93,77 @@ bool operator==(const Vector<type,dim>& a, const Vector<type,dim>& b)
     return true;
 }
 
+template <typename type>
+type Vector<type,3>::norm() const
+{
+  return sqrt(dot(*this));
+}
+
+template <typename type>
+type Vector<type,3>::dot(const Vector<type,3>& a) const
+{
+  Lanes prod = lanes_ * a.lanes_;
+  return prod[0] + prod[1] + prod[2];
+}
+
+template <typename type>
+Vector<type,3> Vector<type,3>::cross(Vector<type,3> a) const
+{
+  // (y, z, x) and (z, x, y) permutations of both vectors
+  typedef decltype (Lanes() < Lanes()) Mask;
+  const Mask yzx = {1, 2, 0, 3};
+  const Mask zxy = {2, 0, 1, 3};
+
+  return Vector(__builtin_shuffle(lanes_, yzx) * __builtin_shuffle(a.lanes_, zxy)
+                - __builtin_shuffle(lanes_, zxy) * __builtin_shuffle(a.lanes_, yzx));
+}
+
+template <typename type>
+Vector<type,3> operator+(Vector<type,3> a, Vector<type,3> b)
+{
+  return Vector<type,3>(a.lanes() + b.lanes());
+}
+
+template <typename type>
+Vector<type,3> operator-(Vector<type,3> a, Vector<type,3> b)
+{
+  return Vector<type,3>(a.lanes() - b.lanes());
+}
+
+template <typename type>
+Vector<type,3> operator*(Vector<type,3> a, type b)
+{
+  return Vector<type,3>(a.lanes() * b);
+}
+
+template <typename type>
+Vector<type,3> operator*(type a, Vector<type,3> b)
+{
+  return b * a;
+}
+
+template <typename type>
+Vector<type,3> operator-(Vector<type,3> a)
+{
+  return Vector<type,3>(-a.lanes());
+}
+
+template <typename type>
+bool operator==(const Vector<type,3>& a, const Vector<type,3>& b)
+{
+  return a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+}
+
+template <typename type>
+Vector<type,3> vmin(Vector<type,3> a, Vector<type,3> b)
+{
+  return Vector<type,3>(b.lanes() < a.lanes() ? b.lanes() : a.lanes());
+}
+
+template <typename type>
+Vector<type,3> vmax(Vector<type,3> a, Vector<type,3> b)
+{
+  return Vector<type,3>(a.lanes() < b.lanes() ? b.lanes() : a.lanes());
+}
+
 #endif
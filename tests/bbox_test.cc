@@ -0,0 +1,73 @@
+// Checks that the fast box tests of the traversals (BasicBBox::intersect with
+// a TraversalRay, and the packet version of mustShoot) agree with the plain
+// mustShoot, for rays whose direction has zero components of either sign.
+// They must hold with the flags of the build (-Ofast), which do not keep the
+// infinities, the NaNs and the signed zeros of IEEE arithmetic.
+
+#include <iostream>
+#include "bbox.hh"
+
+static void report(const char* test, const Ray& ray)
+{
+  Vec3d o = ray.orig();
+  Vec3d d = ray.dir();
+  std::cerr << test << ": origin (" << o[0] << ", " << o[1] << ", " << o[2]
+            << "), direction (" << d[0] << ", " << d[1] << ", " << d[2]
+            << ")" << std::endl;
+}
+
+int main()
+{
+  const NodeBBox box(Vector<accel_t,3>(0, 0, 0), Vector<accel_t,3>(1, 1, 1));
+  const double coords[] = {-1, 0, 0.5, 1, 2};
+  const double comps[] = {-1, -0., 0., 1};
+
+  int rays = 0;
+  int failures = 0;
+  Ray packet_rays[PACKET_SIZE];
+  bool expected[PACKET_SIZE];
+  int lanes = 0;
+
+  for (int o = 0; o < 125; o++)
+  {
+    Vec3d orig(coords[o % 5], coords[o / 5 % 5], coords[o / 25]);
+    for (int d = 0; d < 64; d++)
+    {
+      Vec3d dir(comps[d % 4], comps[d / 4 % 4], comps[d / 16]);
+      if (dir[0] == 0 && dir[1] == 0 && dir[2] == 0)
+        continue;
+
+      Ray ray(orig, dir);
+      bool hit = box.mustShoot(ray);
+      double entry;
+      if (box.intersect(TraversalRay(ray),
+                        std::numeric_limits<double>::max(), entry) != hit)
+      {
+        report("intersect", ray);
+        failures++;
+      }
+      rays++;
+
+      packet_rays[lanes] = ray;
+      expected[lanes++] = hit;
+      if (lanes == PACKET_SIZE)
+      {
+        RayPacket packet(packet_rays, PACKET_SIZE);
+        vmask hits = box.mustShoot(packet, packet.active,
+                                   splat(std::numeric_limits<double>::max()));
+        for (int i = 0; i < PACKET_SIZE; i++)
+        {
+          if ((hits[i] != 0) != expected[i])
+          {
+            report("packet", packet_rays[i]);
+            failures++;
+          }
+        }
+        lanes = 0;
+      }
+    }
+  }
+
+  std::cout << failures << " failures out of " << rays << " rays" << std::endl;
+  return failures == 0 ? 0 : 1;
+}